@@ -0,0 +1,150 @@
+// Control loop benchmark on the host, run with: pio run -e native -t exec
+//
+// Drives control_tick() against the mock expanders in native/ on a virtual
+// clock and reports wall time, I2C traffic and heap allocations for a few
+// representative workloads. With the arguments "mqtt <host> <port> <s>" it
+// runs the MQTT client against a broker instead, see mqtt_soak.cpp.
+#include <Arduino.h>
+#include <Wire.h>
+#include <chrono>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include "control.h"
+#include "mqtt_parser.h"
+
+#define NUM_TICKS 20000
+#define TICKS_BURST 1000 // 5 s between MQTT bursts, longer than the staggered start of all motors
+
+// Addresses of the expanders carrying buttons, see config_button
+#define ADDR_IN_A  0x21
+#define ADDR_IN_B  0x24
+#define ADDR_MIXED 0x22
+
+static uint32_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {free(p);}
+void operator delete(void *p, size_t size) noexcept {free(p);}
+
+typedef void (*Workload)(uint32_t tick);
+
+static void workload_idle(uint32_t tick) {}
+
+// One button on each input expander pressed for 150 ms (past the short
+// press threshold) and released for 50 ms, moving on to the next pin
+static void workload_button_storm(uint32_t tick) {
+    uint8_t value = (tick % 40 < 30) ? 1 << ((tick / 40) % 8) : 0x00;
+    Wire.setInput(ADDR_IN_A, value);
+    Wire.setInput(ADDR_IN_B, value);
+    Wire.setInput(ADDR_MIXED, value & 0x0f);
+}
+
+// A message for every motor every 5 s, parsed and enqueued like the MQTT
+// callback does during a burst. The bursts alternate, one starts all motors
+// one after the other within the supply budget and the next stops them.
+static void workload_mqtt_burst(uint32_t tick) {
+    if (tick % TICKS_BURST != 0) {
+        return;
+    }
+    const char *topic = (tick / TICKS_BURST) % 2 ? "cmnd/shutter/up" : "cmnd/shutter/down";
+    for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+        uint8_t payload = '0' + m;
+        MqttCommand command;
+        if (mqtt_parse(topic, &payload, 1, command) == PARSE_OK) {
+            const MqttVerb &verb = *command.verb;
+            command_push(verb.type, command.motor, verb.direction, control_travel_time(command.motor), ORIGIN_MQTT);
+        }
+    }
+}
+
+// The same scene as a single bulk message every 5 s
+static void workload_mqtt_bulk(uint32_t tick) {
+    if (tick % TICKS_BURST != 0) {
+        return;
+    }
+    const char *payload = (tick / TICKS_BURST) % 2 ? "*:up" : "*:down";
+    MqttCommand command;
+    if (mqtt_parse("cmnd/shutter/bulk", (const uint8_t*)payload, strlen(payload), command) == PARSE_OK) {
+        command_push_bulk(command.bulk, ORIGIN_MQTT, micros());
+    }
+}
+
+// The button expander 0x24 drops off the bus for 25 s and comes back
+static void workload_expander_loss(uint32_t tick) {
+    if (tick == 5000) {
+        Wire.setMissing(ADDR_IN_B, true);
+    } else if (tick == 10000) {
+        Wire.setMissing(ADDR_IN_B, false);
+    }
+}
+
+static void run(const char *name, Workload workload) {
+    // Start from released buttons and stopped motors
+    Wire.setInput(ADDR_IN_A, 0x00);
+    Wire.setInput(ADDR_IN_B, 0x00);
+    Wire.setInput(ADDR_MIXED, 0x00);
+    command_push(MotorCommand::OFF, MOTOR_ALL, Motor::MotorStates::OFF, 0, ORIGIN_BUTTON);
+    for (uint8_t i = 0; i < 200; ++i) {
+        native_advance(TIME_TICK);
+        control_tick();
+    }
+
+    Wire.resetCounters();
+    uint32_t commands_start = commands.pushed();
+    uint32_t allocations_start = allocations;
+    std::chrono::nanoseconds elapsed(0);
+
+    for (uint32_t tick = 0; tick < NUM_TICKS; ++tick) {
+        native_advance(TIME_TICK);
+        workload(tick);
+
+        auto start = std::chrono::steady_clock::now();
+        control_tick();
+        elapsed += std::chrono::steady_clock::now() - start;
+        CommandTrace trace;
+        while (control_take_trace(trace)) {}
+    }
+
+    uint32_t num_commands = commands.pushed() - commands_start;
+    uint32_t num_allocations = allocations - allocations_start;
+    printf("%-14s %8.1f ns/tick %7.3f i2c/tick %7.3f bytes/tick %7.1f bus-us/tick %6u commands %6.3f allocs/command\n",
+           name,
+           (double)elapsed.count() / NUM_TICKS,
+           (double)Wire.transactions / NUM_TICKS,
+           (double)Wire.bytes / NUM_TICKS,
+           Wire.busTime() * 1e6 / NUM_TICKS,
+           num_commands,
+           num_commands ? (double)num_allocations / num_commands : 0.0);
+}
+
+int mqtt_soak(const char *host, uint16_t port, uint32_t seconds);
+
+#ifndef PIO_UNIT_TESTING
+int main(int argc, char **argv) {
+    if (argc == 5 && strcmp(argv[1], "mqtt") == 0) {
+        return mqtt_soak(argv[2], atoi(argv[3]), atoi(argv[4]));
+    }
+
+    control_setup();
+
+    run("idle", workload_idle);
+    run("button-storm", workload_button_storm);
+    run("mqtt-burst", workload_mqtt_burst);
+    run("mqtt-bulk", workload_mqtt_bulk);
+    run("expander-loss", workload_expander_loss);
+
+    if (commands.dropped() != 0) {
+        printf("%u commands dropped\n", commands.dropped());
+    }
+    return 0;
+}
+#endif
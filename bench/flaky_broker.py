@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""Minimal QoS 0 MQTT broker that misbehaves on purpose, a stand-in for
+mosquitto when soaking the client with: bench mqtt 127.0.0.1 1883 <seconds>
+
+Each new connection is refused, blackholed (accepted but never answered),
+answered late or served normally, and served connections are cut after a
+random lifetime. Only CONNECT, SUBSCRIBE, PUBLISH, PINGREQ and DISCONNECT
+are understood, and '#' is the only wildcard.
+"""
+import argparse
+import asyncio
+import random
+
+
+def encode_length(length):
+    out = bytearray()
+    while True:
+        byte = length % 128
+        length //= 128
+        out.append(byte | (0x80 if length else 0))
+        if not length:
+            return bytes(out)
+
+
+def packet(header, body=b""):
+    return bytes([header]) + encode_length(len(body)) + body
+
+
+async def read_packet(reader):
+    header = (await reader.readexactly(1))[0]
+    length, shift = 0, 0
+    while True:
+        byte = (await reader.readexactly(1))[0]
+        length |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            break
+    return header, await reader.readexactly(length)
+
+
+def matches(pattern, topic):
+    if pattern.endswith("#"):
+        return topic.startswith(pattern[:-1])
+    return pattern == topic
+
+
+class Broker:
+    def __init__(self, args):
+        self.args = args
+        self.clients = {}
+        self.counts = {"refused": 0, "blackholed": 0, "delayed": 0, "served": 0, "cut": 0, "publishes": 0}
+
+    def deliver(self, topic, frame):
+        for writer, patterns in self.clients.items():
+            if any(matches(p, topic) for p in patterns):
+                writer.write(frame)
+
+    async def handle(self, reader, writer):
+        args = self.args
+        roll = random.random()
+        if roll < args.refuse:
+            self.counts["refused"] += 1
+            writer.close()
+            return
+        if roll < args.refuse + args.blackhole:
+            self.counts["blackholed"] += 1
+            await asyncio.sleep(args.lifetime)
+            writer.close()
+            return
+        delay = 0
+        if roll < args.refuse + args.blackhole + args.delayed:
+            self.counts["delayed"] += 1
+            delay = random.uniform(0, args.delay)
+        else:
+            self.counts["served"] += 1
+
+        patterns = []
+        try:
+            await asyncio.wait_for(self.serve(reader, writer, patterns, delay),
+                                   random.uniform(0, 2 * args.lifetime))
+        except asyncio.TimeoutError:
+            self.counts["cut"] += 1
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        self.clients.pop(writer, None)
+        writer.close()
+
+    async def serve(self, reader, writer, patterns, delay):
+        while True:
+            header, body = await read_packet(reader)
+            kind = header >> 4
+            if kind == 1:  # CONNECT
+                await asyncio.sleep(delay)
+                writer.write(packet(0x20, b"\x00\x00"))
+                self.clients[writer] = patterns
+            elif kind == 8:  # SUBSCRIBE
+                offset, codes = 2, bytearray()
+                while offset < len(body):
+                    length = int.from_bytes(body[offset:offset + 2], "big")
+                    patterns.append(body[offset + 2:offset + 2 + length].decode())
+                    offset += 2 + length + 1
+                    codes.append(0)
+                writer.write(packet(0x90, body[:2] + bytes(codes)))
+            elif kind == 3:  # PUBLISH, QoS 0 only
+                self.counts["publishes"] += 1
+                length = int.from_bytes(body[:2], "big")
+                self.deliver(body[2:2 + length].decode(), packet(header & 0xF1, body))
+            elif kind == 12:  # PINGREQ
+                writer.write(packet(0xD0))
+            elif kind == 14:  # DISCONNECT
+                return
+            await writer.drain()
+
+    async def report(self):
+        while True:
+            await asyncio.sleep(5)
+            print(" ".join(f"{k} {v}" for k, v in self.counts.items()), flush=True)
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--refuse", type=float, default=0.2, help="share of connections closed right away")
+    parser.add_argument("--blackhole", type=float, default=0.2, help="share of connections never answered")
+    parser.add_argument("--delayed", type=float, default=0.2, help="share of connections answered late")
+    parser.add_argument("--delay", type=float, default=5.0, help="maximum CONNACK delay in seconds")
+    parser.add_argument("--lifetime", type=float, default=10.0, help="mean connection lifetime in seconds")
+    args = parser.parse_args()
+
+    broker = Broker(args)
+    server = await asyncio.start_server(broker.handle, "127.0.0.1", args.port)
+    asyncio.ensure_future(broker.report())
+    async with server:
+        await server.serve_forever()
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
@@ -0,0 +1,57 @@
+// Runs the MQTT client against a real broker, typically bench/flaky_broker.py,
+// and reports how long a single handle() call took at worst. It should stay
+// in the microseconds however the broker misbehaves.
+#include <Arduino.h>
+#include <chrono>
+#include <thread>
+#include "mqtt.h"
+
+static uint32_t received = 0;
+
+static void on_message(char *topic, uint8_t *payload, unsigned int length) {
+    received++;
+}
+
+int mqtt_soak(const char *host, uint16_t port, uint32_t seconds) {
+    static Mqtt mqtt;
+    mqtt.setServer(host, port);
+    mqtt.setCallback(on_message);
+
+    auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    std::chrono::nanoseconds max_handle(0);
+    uint32_t published = 0;
+    uint32_t last_publish = 0;
+    char payload[16];
+
+    while (std::chrono::steady_clock::now() - start < std::chrono::seconds(seconds)) {
+        // Keep the virtual clock in step with the wall clock
+        auto now = std::chrono::steady_clock::now();
+        native_advance(std::chrono::duration_cast<std::chrono::milliseconds>(now - last).count());
+        last += std::chrono::duration_cast<std::chrono::milliseconds>(now - last);
+
+        // A state message every 100 ms and a command to ourselves every second
+        if (millis() - last_publish >= 100) {
+            last_publish = millis();
+            snprintf(payload, sizeof(payload), "%u", published);
+            mqtt.publish("stat/shutter/soak", payload);
+            if (++published % 10 == 0) {
+                mqtt.publish("cmnd/shutter/soak", payload);
+            }
+        }
+
+        auto before = std::chrono::steady_clock::now();
+        mqtt.handle();
+        auto elapsed = std::chrono::steady_clock::now() - before;
+        if (elapsed > max_handle) {
+            max_handle = elapsed;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    char stats[128];
+    mqtt.format(stats, sizeof(stats));
+    printf("%s published %u received %u max handle %.1f us\n", stats, published, received,
+           std::chrono::duration_cast<std::chrono::nanoseconds>(max_handle).count() / 1000.0);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#pragma once
+// Host-side stand-in for the Arduino core, just enough for the headers in src/
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HIGH   0x1
+#define LOW    0x0
+#define INPUT  0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define OUTPUT_OPEN_DRAIN 0x13
+
+#define FALLING 0x02
+#define IRAM_ATTR
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+
+typedef uint8_t byte;
+
+// Virtual clock, only advanced by the host program or delay()
+inline uint64_t native_time_us = 0;
+
+inline void native_advance(uint32_t ms) {native_time_us += (uint64_t)ms * 1000;}
+inline uint32_t millis() {return (uint32_t)(native_time_us / 1000);}
+inline uint32_t micros() {return (uint32_t)native_time_us;}
+inline void delay(uint32_t ms) {native_advance(ms);}
+inline void delayMicroseconds(uint32_t us) {native_time_us += us;}
+
+// Cycle counter of a 240 MHz core, backed by the host clock
+class EspClass {
+public:
+    uint32_t getCycleCount() {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return (uint32_t)(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() * 240 / 1000);
+    }
+    uint32_t getCpuFreqMHz() {return 240;}
+};
+
+inline EspClass ESP;
+
+// Internal GPIOs
+inline uint8_t native_gpio[40] = {};
+
+inline void pinMode(uint8_t pin, uint8_t mode) {}
+inline void digitalWrite(uint8_t pin, uint8_t value) {native_gpio[pin] = value;}
+inline int digitalRead(uint8_t pin) {return native_gpio[pin];}
+
+// Interrupts are not simulated, callers fall back to polling
+inline void attachInterruptArg(uint8_t pin, void (*fn)(void*), void *arg, int mode) {}
+
+// FreeRTOS primitives used by the headers, the host program is single threaded
+typedef struct {
+    uint32_t owner;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
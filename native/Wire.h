@@ -0,0 +1,100 @@
+#pragma once
+// Host-side mock of the Arduino Wire library. Every address behaves like a
+// PCA9534, and all bus traffic is counted so driver changes can be measured.
+#include <Arduino.h>
+
+class TwoWire {
+private:
+    struct Device {
+        uint8_t pointer = 0;
+        uint8_t regs[4] = {0x00, 0x00, 0x00, 0xff};
+        bool missing = false;
+    };
+
+    Device devices[128];
+    uint8_t tx_address = 0;
+    uint8_t tx_buffer[8];
+    uint8_t tx_length = 0;
+    uint8_t rx_value = 0;
+    int rx_available = 0;
+
+public:
+    uint32_t clock = 100000;
+    uint32_t transactions = 0; // Address phases put on the bus
+    uint32_t bytes = 0;        // Data bytes transferred, excluding addresses
+
+    // Idle bus, both lines pulled up
+    bool begin(int sda = 21, int scl = 22) {
+        native_gpio[sda] = HIGH;
+        native_gpio[scl] = HIGH;
+        return true;
+    }
+    bool end() {return true;}
+    bool setClock(uint32_t frequency) {clock = frequency; return true;}
+    uint32_t getClock() {return clock;}
+    void setTimeOut(uint16_t ms) {}
+
+    // Time the counted traffic occupies the bus: start, address and ack,
+    // 9 clocks per data byte and stop
+    double busTime() {return (transactions * 11.0 + bytes * 9.0) / clock;}
+
+    void beginTransmission(uint8_t address) {
+        tx_address = address & 0x7f;
+        tx_length = 0;
+    }
+
+    size_t write(uint8_t value) {
+        if (tx_length >= sizeof(tx_buffer)) {
+            return 0;
+        }
+        tx_buffer[tx_length++] = value;
+        return 1;
+    }
+
+    uint8_t endTransmission(bool stop = true) {
+        Device &dev = devices[tx_address];
+        transactions++;
+        if (dev.missing) {
+            return 2; // Address NACK
+        }
+        bytes += tx_length;
+        if (tx_length >= 1) {
+            dev.pointer = tx_buffer[0] & 0x03;
+        }
+        for (uint8_t i = 1; i < tx_length; ++i) {
+            dev.regs[dev.pointer] = tx_buffer[i];
+        }
+        return 0;
+    }
+
+    uint8_t requestFrom(uint8_t address, unsigned int quantity) {
+        Device &dev = devices[address & 0x7f];
+        transactions++;
+        if (dev.missing) {
+            rx_available = 0;
+            return 0;
+        }
+        bytes += quantity;
+        rx_value = dev.regs[dev.pointer];
+        rx_available = quantity;
+        return quantity;
+    }
+
+    int available() {return rx_available;}
+
+    int read() {
+        if (rx_available <= 0) {
+            return -1;
+        }
+        rx_available--;
+        return rx_value;
+    }
+
+    // Test hooks
+    void setInput(uint8_t address, uint8_t value) {devices[address & 0x7f].regs[0] = value;}
+    void setMissing(uint8_t address, bool missing) {devices[address & 0x7f].missing = missing;}
+    uint8_t getRegister(uint8_t address, uint8_t reg) {return devices[address & 0x7f].regs[reg & 0x03];}
+    void resetCounters() {transactions = 0; bytes = 0;}
+};
+
+inline TwoWire Wire;
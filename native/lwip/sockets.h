@@ -0,0 +1,7 @@
+#pragma once
+// The lwIP socket API follows BSD sockets, the host provides the real thing
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
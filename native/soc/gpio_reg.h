@@ -0,0 +1,23 @@
+#pragma once
+// Stand-in for the ESP32 GPIO set/clear registers, applied to native_gpio
+#include <Arduino.h>
+
+#define GPIO_OUT_W1TS_REG  0
+#define GPIO_OUT_W1TC_REG  1
+#define GPIO_OUT1_W1TS_REG 2
+#define GPIO_OUT1_W1TC_REG 3
+
+inline uint32_t native_reg_writes = 0;
+
+inline void native_reg_write(uint32_t reg, uint32_t value) {
+    uint8_t base = (reg >= GPIO_OUT1_W1TS_REG) ? 32 : 0;
+    uint8_t level = (reg == GPIO_OUT_W1TS_REG || reg == GPIO_OUT1_W1TS_REG) ? HIGH : LOW;
+    for (uint8_t bit = 0; bit < 32 && base + bit < 40; ++bit) {
+        if (value & (1UL << bit)) {
+            native_gpio[base + bit] = level;
+        }
+    }
+    native_reg_writes++;
+}
+
+#define REG_WRITE(reg, value) native_reg_write((reg), (value))
@@ -0,0 +1,30 @@
+#include "boot.h"
+#include "format.h"
+
+static const char *const boot_phase_names[] = {
+    "setup", "control", "tick", "radio", "wifi", "mqtt",
+};
+static_assert(sizeof(boot_phase_names) / sizeof(boot_phase_names[0]) == NUM_BOOT_PHASES, "Missing boot phase name");
+
+// Each phase is only written by a single task
+static volatile uint32_t boot_times[NUM_BOOT_PHASES];
+
+void boot_mark(BootPhase phase)
+{
+    if (boot_times[phase] == 0) {
+        uint32_t now = micros();
+        boot_times[phase] = now != 0 ? now : 1;
+    }
+}
+
+// Renders the phases reached so far as JSON in us
+int boot_format(char *buf, size_t len)
+{
+    int n = snprintf(buf, len, "{");
+    for (uint8_t i = 0; i < NUM_BOOT_PHASES; ++i) {
+        if (boot_times[i] != 0) {
+            n = format_append(buf, len, n, n == 1 ? "\"%s\":%u" : ",\"%s\":%u", boot_phase_names[i], (unsigned)boot_times[i]);
+        }
+    }
+    return format_append(buf, len, n, "}");
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <Arduino.h>
+
+// Milestones of the boot sequence, each recorded once
+enum BootPhase : uint8_t {
+    BOOT_SETUP,   // setup() entered
+    BOOT_CONTROL, // Expanders, motors and buttons configured
+    BOOT_TICK,    // First control tick, buttons are live
+    BOOT_RADIO,   // WiFi started
+    BOOT_WIFI,    // Connected to the access point
+    BOOT_MQTT,    // Connected to the broker
+    NUM_BOOT_PHASES,
+};
+
+void boot_mark(BootPhase phase);
+int boot_format(char *buf, size_t len);
@@ -1,9 +1,24 @@
 #pragma once
 #include <Arduino.h>
-#include <functional>
 #include "debug.h"
+#include "timers.h"
+
+// What a button did, reported to the handler as it is recognised
+enum ButtonGesture : uint8_t {
+    GESTURE_PRESS,  // Held past the short press time
+    GESTURE_SHORT,  // Released before the long press time
+    GESTURE_LONG,   // Released after the long press time
+    GESTURE_DOUBLE, // Pressed again soon after a short press, instead of GESTURE_PRESS
+    GESTURE_HOLD,   // Still held at the long press time
+    NUM_GESTURES,
+};
 
 class Button {
+public:
+    // One plain function serves every button, the mapping from gesture to
+    // action lives in a table
+    typedef void (*Handler)(uint8_t button, ButtonGesture gesture);
+
 private:
     enum ButtonStates {
         IDLE = 0,
@@ -14,53 +29,63 @@ private:
 
     uint8_t id = 0xff;
     enum ButtonStates state = IDLE;
+    bool second = false; // This press follows a short press closely
     uint32_t time_short_press = 100;
     uint32_t time_long_press = 750;
+    uint32_t time_double_press = 400; // From the release of the first press
+    uint32_t time_edge = 0; // micros() of the last debounced edge
+    uint32_t time_released = 0;
+
+    Timers *timers = nullptr;
+    Timers::Handle timer = Timers::INVALID;
+    Handler handler = nullptr;
 
-    uint32_t last_time = 0;
-    std::function<void(uint8_t button)> _action_press = nullptr;
-    std::function<void(uint8_t button)> _action_short = nullptr;
-    std::function<void(uint8_t button)> _action_long = nullptr;
+    void emit(ButtonGesture gesture) {
+        if (handler != nullptr) {
+            handler(id, gesture);
+        }
+    }
+
+    // Press thresholds, counted from the moment the button went down
+    static void timer_expired(void *arg) {
+        Button *button = static_cast<Button*>(arg);
+        if (button->state == PRESSED) {
+            button->state = SHORT_PRESS;
+            printd("Button short: %d", button->id);
+            button->timers->start(button->timer, millis(), button->time_long_press - button->time_short_press);
+            button->emit(button->second ? GESTURE_DOUBLE : GESTURE_PRESS);
+        } else if (button->state == SHORT_PRESS) {
+            button->state = LONG_PRESS;
+            printd("Button long: %d", button->id);
+            button->emit(GESTURE_HOLD);
+        }
+    }
 
     void state_button_idle(uint8_t value) {
         if (value == HIGH) {
             state = PRESSED;
+            second = millis() - time_released < time_double_press;
             printd("Button pressed: %d", id);
-            last_time = millis();
+            timers->start(timer, millis(), time_short_press);
         }
     }
 
     void state_button_pressed(uint8_t value) {
-        if (value == HIGH) {
-            uint32_t time_elapsed = millis() - last_time;
-            if (time_elapsed > time_short_press) {
-                state = SHORT_PRESS;
-                printd("Button short: %d", id);
-                // Run handler
-                if (_action_press != nullptr) {
-                    _action_press(id);
-                }
-            }
-        } else { // LOW
+        if (value == LOW) {
             state = IDLE;
+            timers->cancel(timer);
             printd("Button released: %d", id);
         }
     }
 
     void state_button_short(uint8_t value) {
-        if (value == HIGH) {
-            uint32_t time_elapsed = millis() - last_time;
-            if (time_elapsed > time_long_press) {
-                printd("Button long: %d", id);
-                state = LONG_PRESS;
-            }
-        } else { // LOW
+        if (value == LOW) {
             state = IDLE;
+            timers->cancel(timer);
+            // A double press ends the sequence, a third press starts anew
+            time_released = second ? millis() - time_double_press : millis();
             printd("Button short released: %d", id);
-            // Run handler
-            if (_action_short != nullptr) {
-                _action_short(id);
-            }
+            emit(GESTURE_SHORT);
         }
     }
 
@@ -68,19 +93,24 @@ private:
         if (value == LOW) {
             state = IDLE;
             printd("Button long released: %d", id);
-            // Run handler
-            if (_action_long != nullptr) {
-                _action_long(id);
-            }
+            emit(GESTURE_LONG);
         }
     }
 
 public:
-    void begin(uint8_t id) {
+    void begin(uint8_t id, Timers *timers, Handler handler) {
         this->id = id;
+        this->timers = timers;
+        this->timer = timers->create(timer_expired, this);
+        if (this->timer == Timers::INVALID) {
+            printd("Button %d has no timer, out of timers", id);
+        }
+        this->handler = handler;
+        this->time_released = millis() - time_double_press;
     }
 
     void new_value(uint8_t value) {
+        time_edge = micros();
         switch (state) {
             case IDLE:
                 state_button_idle(value);
@@ -100,18 +130,10 @@ public:
         }
     }
 
-    void onPress(std::function<void(uint8_t button)> fn) {
-        _action_press = fn;
-    }
-
-    void onShort(std::function<void(uint8_t button)> fn) {
-        _action_short = fn;
-    }
-
-    void onLong(std::function<void(uint8_t button)> fn) {
-        _action_long = fn;
-    }
+    // Edge the current gesture comes from, for latency tracing
+    uint32_t getEdgeTime() {return time_edge;}
 
     void set_time_short_press(uint32_t value) {time_short_press = value;}
     void set_time_long_press(uint32_t value) {time_long_press = value;}
-};
\ No newline at end of file
+    void set_time_double_press(uint32_t value) {time_double_press = value;}
+};
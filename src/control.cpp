@@ -0,0 +1,706 @@
+#include <Arduino.h>
+#include <atomic>
+#include <Wire.h>
+#include "button.h"
+#include "control.h"
+#include "debounce.h"
+#include "debug.h"
+#include "format.h"
+#include "gpio.h"
+#include "i2c_bus.h"
+#include "motor.h"
+#include "pca9534.h"
+#include "relay.h"
+#include "starter.h"
+#include "timers.h"
+
+#define NUM_BUTTONS   20
+#define NUM_RELAYS    16
+#define TIME_NORMAL   (33*1000)
+#define TIME_THIN     (37*1000)
+#define TIME_BIG      (73*1000)
+#define TIME_RESYNC   (1*1000)
+#define TIME_DEAD     500    // ms with both relays off before a motor reverses
+#define I2C_CLOCK     400000 // Fast mode, all devices on the bus support it
+#define I2C_TIMEOUT   5      // ms, a transfer to a healthy expander takes < 0.1 ms
+#define PIN_SDA       21
+#define PIN_SCL       22
+// #define PIN_EXPANDER_INT 27 // INT of the input expanders, wired-OR
+
+I2CBus bus(PIN_SDA, PIN_SCL);
+GpioPort port_internal;
+PCA9534 port_out(0x20);
+PCA9534 port_mixed(0x22);
+PCA9534 port_in_a(0x21);
+PCA9534 port_in_b(0x24);
+constexpr PCA9534 *const expanders[] = {&port_out, &port_mixed, &port_in_a, &port_in_b};
+#ifdef PIN_EXPANDER_INT
+PCA9534Interrupt expander_int;
+#endif
+RelayTransaction relays;
+
+// Inrush budget of each motor supply, see StartBudget
+const struct {
+    uint8_t max_starts; // Within the inrush time
+    uint32_t gap;       // ms between two starts
+    uint32_t inrush;    // ms a start draws its peak current
+} config_supply[NUM_SUPPLIES] {
+    [0] = {2, 150, 500},
+};
+
+// Both relays of a motor sit on one port, see RelayInterlock
+constexpr struct {
+    OutputRegister *port;
+    uint8_t up_pin;
+    uint8_t down_pin;
+    uint32_t time_up;   // Full travel times
+    uint32_t time_down;
+    uint8_t supply;     // Index in config_supply
+} config_motor[] {
+    [0] = {&port_internal, 26, 25, TIME_THIN,   TIME_THIN,   0},
+    [1] = {&port_internal, 33, 32, TIME_THIN,   TIME_THIN,   0},
+    [2] = {&port_mixed,     5,  4, TIME_NORMAL, TIME_NORMAL, 0},
+    [3] = {&port_mixed,     7,  6, TIME_NORMAL, TIME_NORMAL, 0},
+    [4] = {&port_out,       1,  0, TIME_NORMAL, TIME_NORMAL, 0},
+    [5] = {&port_out,       3,  2, TIME_NORMAL, TIME_NORMAL, 0},
+    [6] = {&port_out,       4,  5, TIME_BIG,    TIME_BIG,    0},
+    [7] = {&port_out,       6,  7, TIME_THIN,   TIME_THIN,   0},
+};
+static_assert(sizeof(config_motor) / sizeof(config_motor[0]) == NUM_MOTORS, "One config_motor row per motor");
+static_assert(NUM_STARTS_WAITING >= NUM_MOTORS, "Every motor may wait for a start");
+
+// What a gesture does to the motors of its button
+enum ButtonVerb : uint8_t {
+    VERB_NONE,
+    VERB_TOGGLE,   // Start in the button's direction, or stop
+    VERB_RUN,      // Stop after the full travel time, if running
+    VERB_STOP,
+    VERB_POSITION, // Run to the position of the gesture map
+};
+
+struct ButtonGestures {
+    ButtonVerb verb[NUM_GESTURES];
+    uint16_t position; // Per mille, for VERB_POSITION
+};
+
+// Tap to run the full travel, hold to run while held, tap again to stop
+constexpr ButtonGestures GESTURES_MOTOR = {{
+    [GESTURE_PRESS]  = VERB_TOGGLE,
+    [GESTURE_SHORT]  = VERB_RUN,
+    [GESTURE_LONG]   = VERB_STOP,
+    [GESTURE_DOUBLE] = VERB_TOGGLE,
+    [GESTURE_HOLD]   = VERB_NONE,
+}, 0};
+
+#define MOTOR(m)   (1 << (m))
+#define MOTORS_ALL ((1 << NUM_MOTORS) - 1)
+#define MOTORS_LIVING (MOTOR(0) | MOTOR(1) | MOTOR(3) | MOTOR(6) | MOTOR(7))
+static_assert(NUM_MOTORS <= 8, "Motor sets are 8 bit masks");
+
+constexpr struct {
+    PCA9534 *port;
+    uint8_t pin;
+    uint8_t motors;
+    enum Motor::MotorStates direction;
+    const ButtonGestures *gestures;
+} config_button[] {
+    {&port_in_b,  7, MOTOR(3),      Motor::MotorStates::UP,   &GESTURES_MOTOR}, // Nappali ablak fel
+    {&port_in_b,  5, MOTOR(3),      Motor::MotorStates::DOWN, &GESTURES_MOTOR}, // Nappali ablak le
+    {&port_mixed, 1, MOTOR(1),      Motor::MotorStates::UP,   &GESTURES_MOTOR}, // Nappali 1 fel
+    {&port_mixed, 3, MOTOR(1),      Motor::MotorStates::DOWN, &GESTURES_MOTOR}, // Nappali 1 le
+    {&port_in_a,  1, MOTOR(0),      Motor::MotorStates::UP,   &GESTURES_MOTOR}, // Nappali 2 fel
+    {&port_in_a,  3, MOTOR(0),      Motor::MotorStates::DOWN, &GESTURES_MOTOR}, // Nappali 2 le
+    {&port_in_a,  6, MOTOR(7),      Motor::MotorStates::UP,   &GESTURES_MOTOR}, // Nappali 3 fel
+    {&port_in_a,  4, MOTOR(7),      Motor::MotorStates::DOWN, &GESTURES_MOTOR}, // Nappali 3 le
+    {&port_in_b,  1, MOTOR(6),      Motor::MotorStates::UP,   &GESTURES_MOTOR}, // Nappali ajtó fel
+    {&port_in_b,  3, MOTOR(6),      Motor::MotorStates::DOWN, &GESTURES_MOTOR}, // Nappali ajtó le
+    {&port_in_b,  6, MOTORS_LIVING, Motor::MotorStates::UP,   &GESTURES_MOTOR}, // Nappali közös fel
+    {&port_in_b,  4, MOTORS_LIVING, Motor::MotorStates::DOWN, &GESTURES_MOTOR}, // Nappali közös le
+    {&port_in_a,  7, MOTOR(2),      Motor::MotorStates::UP,   &GESTURES_MOTOR}, // Konyha fel
+    {&port_in_a,  5, MOTOR(2),      Motor::MotorStates::DOWN, &GESTURES_MOTOR}, // Konyha le
+    {&port_in_b,  2, MOTORS_ALL,    Motor::MotorStates::UP,   &GESTURES_MOTOR}, // Bejárat fel, minden
+    {&port_in_b,  0, MOTOR(2),      Motor::MotorStates::DOWN, &GESTURES_MOTOR}, // Bejárat le
+    {&port_mixed, 0, MOTOR(4),      Motor::MotorStates::UP,   &GESTURES_MOTOR}, // Dolgozó fel
+    {&port_mixed, 2, MOTOR(4),      Motor::MotorStates::DOWN, &GESTURES_MOTOR}, // Dolgozó le
+    {&port_in_a,  0, MOTOR(5),      Motor::MotorStates::UP,   &GESTURES_MOTOR}, // Vendég fel 
+    {&port_in_a,  2, MOTOR(5),      Motor::MotorStates::DOWN, &GESTURES_MOTOR}, // Vendég le
+};
+static_assert(sizeof(config_button) / sizeof(config_button[0]) == NUM_BUTTONS, "One config_button row per button");
+static_assert(NUM_TIMERS >= NUM_BUTTONS + NUM_MOTORS, "Every button and motor needs a timer");
+
+// Expanders whose pins are scanned for buttons
+constexpr PCA9534 *const input_ports[] = {&port_in_a, &port_in_b, &port_mixed};
+
+// The I/O maps below are derived from the tables above by the compiler, and
+// the wiring is checked along the way
+
+#define NO_BUTTON 0xff
+
+constexpr uint64_t pin_mask(uint8_t pin)
+{
+    return 1ULL << pin;
+}
+
+// Pins of an expander wired to buttons, the ones configured as inputs
+constexpr uint8_t button_pins(const PCA9534 *port, uint8_t i = 0)
+{
+    return i == NUM_BUTTONS ? 0 :
+           (uint8_t)((config_button[i].port == port ? pin_mask(config_button[i].pin) : 0) | button_pins(port, i + 1));
+}
+
+// First button on a pin, NO_BUTTON if there is none
+constexpr uint8_t button_on(const PCA9534 *port, uint8_t pin, uint8_t i = 0)
+{
+    return i == NUM_BUTTONS ? NO_BUTTON :
+           (config_button[i].port == port && config_button[i].pin == pin) ? i : button_on(port, pin, i + 1);
+}
+
+// Pins of a port driving relays
+constexpr uint64_t relay_pins(const OutputRegister *port, uint8_t m = 0)
+{
+    return m == NUM_MOTORS ? 0 :
+           (config_motor[m].port == port ? pin_mask(config_motor[m].up_pin) | pin_mask(config_motor[m].down_pin) : 0) |
+           relay_pins(port, m + 1);
+}
+
+// First motor with a relay on a pin, NUM_MOTORS if there is none
+constexpr uint8_t relay_on(const OutputRegister *port, uint8_t pin, uint8_t m = 0)
+{
+    return m == NUM_MOTORS ? NUM_MOTORS :
+           (config_motor[m].port == port && (config_motor[m].up_pin == pin || config_motor[m].down_pin == pin)) ? m :
+           relay_on(port, pin, m + 1);
+}
+
+constexpr bool is_input_port(const PCA9534 *port, uint8_t i = 0)
+{
+    return i < sizeof(input_ports) / sizeof(input_ports[0]) && (input_ports[i] == port || is_input_port(port, i + 1));
+}
+
+constexpr bool is_expander(const OutputRegister *port, uint8_t i = 0)
+{
+    return i < sizeof(expanders) / sizeof(expanders[0]) && (expanders[i] == port || is_expander(port, i + 1));
+}
+
+// Relays sit on the internal port or on an expander the transaction flushes
+constexpr bool is_relay_port(const OutputRegister *port)
+{
+    return port == &port_internal || is_expander(port);
+}
+
+constexpr bool buttons_valid(uint8_t i = 0)
+{
+    return i == NUM_BUTTONS || (
+        config_button[i].pin < 8 &&
+        is_input_port(config_button[i].port) &&
+        button_on(config_button[i].port, config_button[i].pin) == i && // No other button on the pin
+        config_button[i].motors != 0 && (config_button[i].motors & ~MOTORS_ALL) == 0 &&
+        buttons_valid(i + 1));
+}
+
+constexpr bool motors_valid(uint8_t m = 0)
+{
+    return m == NUM_MOTORS || (
+        is_relay_port(config_motor[m].port) &&
+        config_motor[m].up_pin != config_motor[m].down_pin &&
+        config_motor[m].up_pin < (config_motor[m].port == &port_internal ? 40 : 8) &&
+        config_motor[m].down_pin < (config_motor[m].port == &port_internal ? 40 : 8) &&
+        relay_on(config_motor[m].port, config_motor[m].up_pin) == m && // No other motor on the pins
+        relay_on(config_motor[m].port, config_motor[m].down_pin) == m &&
+        config_motor[m].supply < NUM_SUPPLIES &&
+        motors_valid(m + 1));
+}
+
+constexpr bool expanders_valid(uint8_t i = 0)
+{
+    return i == sizeof(expanders) / sizeof(expanders[0]) || (
+        (relay_pins(expanders[i]) & button_pins(expanders[i])) == 0 &&
+        expanders_valid(i + 1));
+}
+
+static_assert(buttons_valid(), "config_button: pin out of range or taken, port not scanned, or bad motor set");
+static_assert(motors_valid(), "config_motor: unknown port, pin out of range or taken, or bad supply");
+static_assert(expanders_valid(), "A pin drives a relay and reads a button");
+
+// Expander carrying buttons, with the button index for each pin
+struct InputPort {
+    PCA9534 *port;
+    uint8_t mask;
+    uint8_t button[8];
+    Debouncer debouncer;
+};
+
+#define INPUT_PORT(port) {port, button_pins(port), { \
+    button_on(port, 0), button_on(port, 1), button_on(port, 2), button_on(port, 3), \
+    button_on(port, 4), button_on(port, 5), button_on(port, 6), button_on(port, 7)}, Debouncer()}
+
+InputPort inputs[] {
+    INPUT_PORT(input_ports[0]),
+    INPUT_PORT(input_ports[1]),
+    INPUT_PORT(input_ports[2]),
+};
+static_assert(sizeof(inputs) / sizeof(inputs[0]) == sizeof(input_ports) / sizeof(input_ports[0]), "One InputPort per input port");
+
+Timers timers;
+Starter starter;
+Motor motors[NUM_MOTORS];
+Button buttons[NUM_BUTTONS];
+
+CommandQueue commands;
+#ifdef PROFILER
+static const char *const control_stage_names[] = {
+    "buttons", "timers", "commands", "port_mixed", "port_in_a", "port_in_b", "port_out", "snapshot", "tick",
+};
+Profiler<NUM_CONTROL_STAGES> control_profiler(control_stage_names);
+#endif
+static Shared<ControlSnapshot> snapshot;
+
+// Bus traffic and health, copied out each tick as the expanders and the bus
+// are only touched by the control task
+struct I2cStats {
+    uint32_t clock;
+    uint32_t recoveries;
+    uint32_t errors;
+    struct {
+        uint8_t address;
+        bool healthy;
+        uint32_t transactions;
+        uint32_t bytes;
+        uint32_t errors;
+        uint32_t retries;
+    } expander[sizeof(expanders) / sizeof(expanders[0])];
+};
+static Shared<I2cStats> i2c_stats;
+static std::atomic<uint16_t> trace_next{0};
+static CommandTrace tick_traces[CommandQueue::capacity()]; // Applied this tick
+static uint8_t tick_num_traces = 0;
+static MpscRing<CommandTrace, NUM_TRACES> traces; // Written, for the network task
+static std::atomic<uint8_t> motors_changed{0};
+static Motor::MotorStates motors_last[NUM_MOTORS];
+static Motor::MotorStates motors_last_pending[NUM_MOTORS];
+static BulkCommand bulk_slots[NUM_BULK];
+static std::atomic<bool> bulk_busy[NUM_BULK];
+static uint32_t i2c_errors_last = 0;
+static uint32_t tick_last = 0;
+static std::atomic<uint32_t> tick_gap_max{0};
+static std::atomic<bool> motors_held{false};
+
+// Turns a gesture into one command for the motors of the button
+static void button_gesture(uint8_t button, ButtonGesture gesture)
+{
+    const ButtonGestures &gestures = *config_button[button].gestures;
+    uint8_t mask = config_button[button].motors;
+    Motor::MotorStates direction = config_button[button].direction;
+    uint32_t received = buttons[button].getEdgeTime();
+
+    switch (gestures.verb[gesture]) {
+        case VERB_TOGGLE:
+            command_push_group(MotorCommand::TOGGLE, mask, direction, 0, ORIGIN_BUTTON, received);
+            break;
+        case VERB_RUN:
+            command_push_group(MotorCommand::TIMER, mask, direction, DURATION_TRAVEL, ORIGIN_BUTTON, received);
+            break;
+        case VERB_STOP:
+            command_push_group(MotorCommand::OFF, mask, direction, 0, ORIGIN_BUTTON, received);
+            break;
+        case VERB_POSITION:
+            command_push_group(MotorCommand::POSITION, mask, direction, gestures.position, ORIGIN_BUTTON, received);
+            break;
+        default: // VERB_NONE
+            break;
+    }
+}
+
+void control_setup()
+{
+    // Configure I2C
+    bus.begin(I2C_CLOCK, I2C_TIMEOUT);
+
+    // Configure pins, button pins are the inputs
+    port_internal.begin(relay_pins(&port_internal));
+
+    port_out.configure(button_pins(&port_out));
+    port_out.setResyncInterval(TIME_RESYNC);
+    port_out.setPolling(false); // Inputs only mirror the relay outputs
+    port_out.begin();
+
+    port_mixed.configure(button_pins(&port_mixed));
+    port_mixed.setResyncInterval(TIME_RESYNC);
+    port_mixed.begin();
+
+    port_in_a.configure(button_pins(&port_in_a));
+    port_in_a.setResyncInterval(TIME_RESYNC);
+    port_in_a.begin();
+
+    port_in_b.configure(button_pins(&port_in_b));
+    port_in_b.setResyncInterval(TIME_RESYNC);
+    port_in_b.begin();
+
+#ifdef PIN_EXPANDER_INT
+    expander_int.begin(PIN_EXPANDER_INT, {&port_in_a, &port_in_b, &port_mixed});
+#endif
+    relays.setup(&port_internal);
+    for (PCA9534 *port : expanders) {
+        if (relay_pins(port) != 0) {
+            relays.add(port);
+        }
+    }
+
+    // Configure motors
+    for (uint8_t i = 0; i < NUM_SUPPLIES; ++i) {
+        starter.configure(i, config_supply[i].max_starts, config_supply[i].gap, config_supply[i].inrush);
+    }
+    for (uint8_t i = 0; i < NUM_MOTORS; ++i) {
+        motors[i].begin(
+            i,
+            RelayInterlock(config_motor[i].port, pin_mask(config_motor[i].up_pin), pin_mask(config_motor[i].down_pin)),
+            config_motor[i].time_up,
+            config_motor[i].time_down,
+            &timers,
+            &starter,
+            config_motor[i].supply
+        );
+        motors[i].setDeadTime(TIME_DEAD);
+    }
+
+    // Configure buttons
+    for (uint8_t i = 0; i < NUM_BUTTONS; ++i) {
+        buttons[i].begin(i, &timers, button_gesture);
+    }
+}
+
+static uint32_t i2c_errors()
+{
+    uint32_t errors = 0;
+    for (PCA9534 *port : expanders) {
+        errors += port->getErrors();
+    }
+    return errors;
+}
+
+static void i2c_stats_store(uint32_t errors)
+{
+    I2cStats stats;
+    stats.clock = bus.getClock();
+    stats.recoveries = bus.getRecoveries();
+    stats.errors = errors;
+    for (uint8_t i = 0; i < sizeof(expanders) / sizeof(expanders[0]); ++i) {
+        PCA9534 *port = expanders[i];
+        stats.expander[i] = {port->getAddress(), port->isHealthy(), port->getTransactions(), port->getBytes(),
+                             port->getErrors(), port->getRetries()};
+    }
+    i2c_stats.store(stats);
+}
+
+// Failed transfers and bus recoveries so far, to notice new faults
+uint32_t control_i2c_faults()
+{
+    I2cStats stats = i2c_stats.load();
+    return stats.errors + stats.recoveries;
+}
+
+// Bus traffic and health of each expander as JSON
+int control_format_i2c(char *buf, size_t len)
+{
+    I2cStats stats = i2c_stats.load();
+    int n = snprintf(buf, len, "{\"clock\":%u,\"recoveries\":%u", (unsigned)stats.clock, (unsigned)stats.recoveries);
+    for (const auto &port : stats.expander) {
+        n = format_append(buf, len, n, ",\"0x%02x\":{\"ok\":%u,\"n\":%u,\"bytes\":%u,\"err\":%u,\"retry\":%u}",
+                      port.address, port.healthy, (unsigned)port.transactions, (unsigned)port.bytes,
+                      (unsigned)port.errors, (unsigned)port.retries);
+    }
+    return format_append(buf, len, n, "}");
+}
+
+// Fill and drop counters of the command queue and the time until the next
+// timer or delayed start, -1 if none, as JSON
+int control_format_queue(char *buf, size_t len)
+{
+    uint32_t next_deadline = control_snapshot().next_deadline;
+    return snprintf(buf, len, "{\"depth\":%u,\"high_water\":%u,\"pushed\":%u,\"dropped\":%u,\"next_deadline_ms\":%d}",
+                    (unsigned)commands.depth(), (unsigned)commands.high_water(), (unsigned)commands.pushed(),
+                    (unsigned)commands.dropped(), next_deadline == UINT32_MAX ? -1 : (int)next_deadline);
+}
+
+// Before the control task starts
+void control_restore(uint8_t motor, uint16_t position, uint32_t runs, uint32_t run_time)
+{
+    motors[motor].restore(position, runs, run_time);
+}
+
+uint32_t control_travel_time(uint8_t motor)
+{
+    uint32_t time_up = config_motor[motor].time_up;
+    uint32_t time_down = config_motor[motor].time_down;
+    return time_up > time_down ? time_up : time_down;
+}
+
+ControlSnapshot control_snapshot()
+{
+    return snapshot.load();
+}
+
+bool control_take_trace(CommandTrace &trace)
+{
+    return traces.pop(trace);
+}
+
+uint8_t control_take_changes()
+{
+    return motors_changed.exchange(0);
+}
+
+uint32_t control_take_max_gap()
+{
+    return tick_gap_max.exchange(0);
+}
+
+bool command_push(MotorCommand::Type type, uint8_t motor, Motor::MotorStates direction, uint32_t duration, CommandOrigin origin)
+{
+    return command_push(type, motor, direction, duration, origin, micros());
+}
+
+static bool command_enqueue(MotorCommand::Type type, uint8_t motor, uint8_t motors, Motor::MotorStates direction,
+                            uint32_t duration, CommandOrigin origin, uint32_t received)
+{
+    uint16_t trace = trace_next.fetch_add(1, std::memory_order_relaxed);
+    uint32_t reserve = origin == ORIGIN_MQTT ? NUM_COMMANDS_RESERVED : 0;
+    if (!commands.push({type, motor, motors, direction, duration, origin, trace, received, micros()}, reserve)) {
+        printd("Command for motor {%d} dropped, queue full (%u dropped)", motor, commands.dropped());
+        return false;
+    }
+    return true;
+}
+
+bool command_push(MotorCommand::Type type, uint8_t motor, Motor::MotorStates direction, uint32_t duration, CommandOrigin origin,
+                  uint32_t received)
+{
+    return command_enqueue(type, motor, 0, direction, duration, origin, received);
+}
+
+bool command_push_group(MotorCommand::Type type, uint8_t motors, Motor::MotorStates direction, uint32_t duration,
+                        CommandOrigin origin, uint32_t received)
+{
+    return command_enqueue(type, MOTOR_GROUP, motors, direction, duration, origin, received);
+}
+
+void control_hold_motors(bool hold)
+{
+    motors_held = hold;
+}
+
+bool command_push_bulk(const BulkCommand &bulk, CommandOrigin origin, uint32_t received)
+{
+    for (uint8_t slot = 0; slot < NUM_BULK; ++slot) {
+        bool expected = false;
+        if (!bulk_busy[slot].compare_exchange_strong(expected, true)) {
+            continue;
+        }
+        bulk_slots[slot] = bulk;
+        if (command_push(MotorCommand::BULK, slot, Motor::MotorStates::OFF, 0, origin, received)) {
+            return true;
+        }
+        bulk_busy[slot] = false;
+        return false;
+    }
+    printd("Bulk command dropped, no free slot");
+    return false;
+}
+
+static void motor_apply(uint8_t m, MotorCommand::Type type, Motor::MotorStates direction, uint32_t duration)
+{
+    bool stop = type == MotorCommand::OFF || (type == MotorCommand::SET && direction == Motor::MotorStates::OFF) ||
+                (type == MotorCommand::TOGGLE && motors[m].isActive());
+    if (!stop && motors_held.load(std::memory_order_relaxed)) {
+        printd("Motor {%d} command ignored, motors are held", m);
+        return;
+    }
+    if (duration == DURATION_TRAVEL) {
+        duration = control_travel_time(m);
+    }
+    switch (type) {
+        case MotorCommand::TOGGLE:
+            motors[m].toggle(direction);
+            if (duration != 0 && motors[m].isActive()) {
+                motors[m].timer_set(duration);
+            }
+            break;
+        case MotorCommand::SET:
+            if (direction == Motor::MotorStates::OFF) {
+                motors[m].off();
+                break;
+            }
+            if (motors[m].getState() != direction) {
+                motors[m].set(direction);
+            }
+            if (duration != 0) {
+                motors[m].timer_set(duration);
+            }
+            break;
+        case MotorCommand::TIMER:
+            if (motors[m].isActive()) {
+                motors[m].timer_set(duration);
+            }
+            break;
+        case MotorCommand::POSITION:
+            motors[m].moveTo(duration);
+            break;
+        default: // OFF
+            motors[m].off();
+            break;
+    }
+}
+
+static void command_apply(const MotorCommand &command)
+{
+    uint8_t report = 0;
+    Motor::MotorStates relays_before[NUM_MOTORS];
+    for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+        relays_before[m] = motors[m].get();
+    }
+
+    if (command.type == MotorCommand::BULK) {
+        const BulkCommand &bulk = bulk_slots[command.motor];
+        for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+            if (bulk.mask & (1 << m)) {
+                const BulkCommand::Action &action = bulk.actions[m];
+                motor_apply(m, action.type, action.direction, action.duration);
+            }
+        }
+        report = bulk.mask;
+        bulk_busy[command.motor] = false;
+    } else if (command.motor == MOTOR_ALL || command.motor == MOTOR_GROUP) {
+        report = command.motor == MOTOR_ALL ? MOTORS_ALL : command.motors;
+        for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+            if (report & (1 << m)) {
+                motor_apply(m, command.type, command.direction, command.duration);
+            }
+        }
+    } else {
+        motor_apply(command.motor, command.type, command.direction, command.duration);
+        report = 1 << command.motor;
+    }
+
+    CommandTrace &trace = tick_traces[tick_num_traces++];
+    trace.id = command.trace;
+    trace.origin = command.origin;
+    trace.report = command.origin == ORIGIN_MQTT ? report : 0;
+    // A start deferred by the supply budget or the dead time writes nothing
+    // yet, it is not counted as written
+    trace.written = false;
+    for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+        trace.written |= motors[m].get() != relays_before[m];
+    }
+    trace.received = command.received;
+    trace.hop[HOP_PARSED] = command.parsed;
+    trace.hop[HOP_SCHEDULED] = micros();
+}
+
+void control_tick()
+{
+    PROFILE_BEGIN(control_profiler);
+
+    // Lateness shows stalls, e.g. while the flash is written
+    uint32_t tick_current = micros();
+    uint32_t gap = tick_current - tick_last;
+    if (tick_last != 0 && gap > tick_gap_max) {
+        tick_gap_max = gap;
+    }
+    tick_last = tick_current;
+
+    // Debounce whole input words, buttons only see the edges
+    for (InputPort &input : inputs) {
+        uint8_t edges = input.debouncer.update(input.port->read() & input.mask);
+        while (edges != 0) {
+            uint8_t pin = __builtin_ctz(edges);
+            edges &= edges - 1;
+            buttons[input.button[pin]].new_value(bitRead(input.debouncer.get(), pin));
+        }
+    }
+    PROFILE_MARK(control_profiler, STAGE_BUTTONS);
+
+    // Every relay change of this tick goes out in one batch
+    relays.begin();
+
+    // Handle motor run timeouts and button thresholds that are due
+    timers.expire(millis());
+    PROFILE_MARK(control_profiler, STAGE_TIMERS);
+
+    // Apply everything queued since the last tick, including button actions
+    MotorCommand command;
+    tick_num_traces = 0;
+    while (tick_num_traces < CommandQueue::capacity() && commands.pop(command)) {
+        command_apply(command);
+    }
+
+    // Begin the delayed starts the supply budget allows by now
+    starter.handle(millis());
+
+    // Stop motors whose relays can no longer be reached, their outputs are
+    // restored once the expander answers again
+    for (Motor &motor : motors) {
+        if (motor.isActive() && !motor.isReachable()) {
+            printd("Motor {%d} stopped, expander unreachable", motor.getId());
+            motor.off();
+        }
+    }
+    relays.commit();
+    uint32_t written = micros();
+    PROFILE_MARK(control_profiler, STAGE_COMMANDS);
+
+    // Handle port expanders
+#ifdef PIN_EXPANDER_INT
+    expander_int.handle();
+#endif
+    port_mixed.handle();
+    PROFILE_MARK(control_profiler, STAGE_PORT_MIXED);
+    port_in_a.handle();
+    PROFILE_MARK(control_profiler, STAGE_PORT_IN_A);
+    port_in_b.handle();
+    PROFILE_MARK(control_profiler, STAGE_PORT_IN_B);
+    port_out.handle();
+    PROFILE_MARK(control_profiler, STAGE_PORT_OUT);
+
+    // A stuck bus fails every transfer, free it after new errors
+    uint32_t errors = i2c_errors();
+    if (errors != i2c_errors_last) {
+        i2c_errors_last = errors;
+        if (bus.handle()) {
+            for (PCA9534 *port : expanders) {
+                port->invalidate();
+            }
+        }
+    }
+    i2c_stats_store(errors);
+
+    // Publish state for other tasks
+    ControlSnapshot state;
+    uint32_t next_timer = timers.next(millis());
+    uint32_t next_start = starter.next(millis());
+    state.next_deadline = next_start < next_timer ? next_start : next_timer;
+    uint8_t changed = 0;
+    for (uint8_t i = 0; i < NUM_MOTORS; ++i) {
+        state.motor_state[i] = motors[i].getState();
+        state.motor_pending[i] = motors[i].getPending();
+        state.position[i] = motors[i].getPosition();
+        state.runs[i] = motors[i].getRuns();
+        state.run_time[i] = motors[i].getRunTime();
+        if (state.motor_state[i] != motors_last[i] || state.motor_pending[i] != motors_last_pending[i]) {
+            motors_last[i] = state.motor_state[i];
+            motors_last_pending[i] = state.motor_pending[i];
+            changed |= 1 << i;
+        }
+    }
+    snapshot.store(state);
+
+    // Hand over the commands of this tick once the snapshot shows their
+    // result, the acknowledgement reads it
+    for (uint8_t i = 0; i < tick_num_traces; ++i) {
+        tick_traces[i].hop[HOP_WRITTEN] = tick_traces[i].written ? written : 0;
+        traces.push(tick_traces[i]);
+    }
+    if (changed != 0) {
+        motors_changed |= changed;
+    }
+    PROFILE_MARK(control_profiler, STAGE_SNAPSHOT);
+    PROFILE_END(control_profiler, STAGE_TICK);
+}
\ No newline at end of file
@@ -0,0 +1,143 @@
+#pragma once
+#include <Arduino.h>
+#include "motor.h"
+#include "profiler.h"
+#include "ring.h"
+#include "trace.h"
+
+#define NUM_MOTORS 8
+#define MOTOR_ALL  0xff
+#define MOTOR_GROUP 0xfe // The motors in MotorCommand::motors
+#define DURATION_TRAVEL UINT32_MAX // The full travel time of each motor
+#define TIME_TICK  5 // Control task period in ms
+#define NUM_BULK   2 // Bulk commands in flight
+#define NUM_TRACES 32 // Written commands waiting for the network task
+
+enum CommandOrigin : uint8_t {
+    ORIGIN_BUTTON,
+    ORIGIN_MQTT,
+    ORIGIN_SYSTEM, // Safety stops, e.g. before an update
+    NUM_ORIGINS,
+};
+
+// Request for the control task, the only context that touches the motors
+struct MotorCommand {
+    enum Type : uint8_t {
+        TOGGLE, // Start in direction if stopped, stop otherwise
+        OFF,
+        TIMER,  // Arm the stop timer if the motor is running
+        SET,    // Run in direction, or stop for OFF, whatever the current state
+        BULK,   // Apply the BulkCommand in slot `motor`
+        POSITION, // Run to the position in `duration`, in per mille
+    };
+
+    Type type;
+    uint8_t motor;               // Index, MOTOR_ALL or MOTOR_GROUP
+    uint8_t motors;              // Set of motors for MOTOR_GROUP
+    Motor::MotorStates direction;
+    uint32_t duration;           // Stop timer in ms, 0 = none
+    CommandOrigin origin;
+    uint16_t trace;              // Id for latency tracing
+    uint32_t received;           // micros() of the input, see TraceHop
+    uint32_t parsed;
+};
+
+// Actions for several motors, applied together in one control tick
+struct BulkCommand {
+    struct Action {
+        MotorCommand::Type type;
+        Motor::MotorStates direction;
+        uint32_t duration;
+    };
+
+    uint8_t mask; // Motors with an action
+    Action actions[NUM_MOTORS];
+};
+
+// Commands from buttons, MQTT and other sources to the motor engine, which
+// drains it once per control tick
+typedef MpscRing<MotorCommand, 16> CommandQueue;
+#define NUM_COMMANDS_RESERVED 4 // Slots MQTT cannot take, kept for buttons and safety stops
+
+// A command once the control task applied it, handed to the network task to
+// publish the response and collect the latencies
+struct CommandTrace {
+    uint16_t id;
+    CommandOrigin origin;
+    uint8_t report;             // Motors to acknowledge over MQTT
+    bool written;               // Changed a relay output, hop[HOP_WRITTEN] is valid
+    uint32_t received;          // micros()
+    uint32_t hop[NUM_TRACE_HOPS]; // micros() at each hop
+};
+
+// Value written by one task and copied out by others
+template <typename T>
+class Shared {
+private:
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    T value;
+
+public:
+    void store(const T &v) {
+        portENTER_CRITICAL(&mux);
+        value = v;
+        portEXIT_CRITICAL(&mux);
+    }
+
+    T load() {
+        portENTER_CRITICAL(&mux);
+        T v = value;
+        portEXIT_CRITICAL(&mux);
+        return v;
+    }
+};
+
+// Boundary between the control and network tasks
+struct ControlSnapshot {
+    Motor::MotorStates motor_state[NUM_MOTORS];
+    Motor::MotorStates motor_pending[NUM_MOTORS]; // Held back start while OFF, see Motor::getPending()
+    uint16_t position[NUM_MOTORS]; // Per mille or POSITION_UNKNOWN
+    uint32_t runs[NUM_MOTORS];
+    uint32_t run_time[NUM_MOTORS]; // s
+    uint32_t next_deadline; // ms until the next timer or delayed start, UINT32_MAX if none
+};
+
+// Stages of control_tick() for the profiler
+enum ControlStage : uint8_t {
+    STAGE_BUTTONS,
+    STAGE_TIMERS,
+    STAGE_COMMANDS,
+    STAGE_PORT_MIXED,
+    STAGE_PORT_IN_A,
+    STAGE_PORT_IN_B,
+    STAGE_PORT_OUT,
+    STAGE_SNAPSHOT,
+    STAGE_TICK, // Whole tick
+    NUM_CONTROL_STAGES,
+};
+
+extern CommandQueue commands;
+#ifdef PROFILER
+extern Profiler<NUM_CONTROL_STAGES> control_profiler;
+#endif
+
+void control_setup();
+void control_tick();
+void control_restore(uint8_t motor, uint16_t position, uint32_t runs, uint32_t run_time);
+// `received` is the micros() of the input the command comes from, now if omitted
+bool command_push(MotorCommand::Type type, uint8_t motor, Motor::MotorStates direction, uint32_t duration, CommandOrigin origin);
+bool command_push(MotorCommand::Type type, uint8_t motor, Motor::MotorStates direction, uint32_t duration, CommandOrigin origin,
+                  uint32_t received);
+// One command for a set of motors, applied to all of them or dropped as a whole
+bool command_push_group(MotorCommand::Type type, uint8_t motors, Motor::MotorStates direction, uint32_t duration,
+                        CommandOrigin origin, uint32_t received);
+bool command_push_bulk(const BulkCommand &bulk, CommandOrigin origin, uint32_t received);
+void control_hold_motors(bool hold); // While set, only stops are applied, e.g. during an update
+uint32_t control_travel_time(uint8_t motor);
+ControlSnapshot control_snapshot();
+int control_format_i2c(char *buf, size_t len);
+int control_format_queue(char *buf, size_t len);
+uint32_t control_i2c_faults();
+bool control_take_trace(CommandTrace &trace); // Next command applied, in order
+uint8_t control_take_changes(); // Motors whose state changed since the last call
+uint32_t control_take_max_gap(); // Longest time between two ticks since the last call, in us
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+
+// Debounces 8 inputs at once with 2-bit vertical counters: bit i of cnt0 and
+// cnt1 together count how many consecutive samples input i has differed from
+// its debounced state. An input flips after 4 such samples; any sample that
+// agrees with the debounced state resets its counter.
+class Debouncer {
+private:
+    uint8_t state = 0x00; // Debounced inputs
+    uint8_t cnt0 = 0xff;
+    uint8_t cnt1 = 0xff;
+
+public:
+    // Feeds a new sample, returns the inputs whose debounced state changed
+    uint8_t update(uint8_t sample) {
+        uint8_t delta = state ^ sample;
+        cnt0 = ~(cnt0 & delta);
+        cnt1 = cnt0 ^ (cnt1 & delta);
+        uint8_t toggle = delta & cnt0 & cnt1;
+        state ^= toggle;
+        return toggle;
+    }
+
+    uint8_t get() {return state;}
+};
\ No newline at end of file
@@ -1,31 +1,98 @@
 #include "debug.h"
-#include <stdarg.h>
 #include "RemoteDebug.h"
 
+#define DEBUG_HISTORY 20 // Entries shown by the "log" command
+
 static RemoteDebug Debug;
+static SemaphoreHandle_t debug_lock = nullptr; // RemoteDebug is used from several tasks
+static const char *debug_help = nullptr;
+static void (*debug_handler)(const char *command) = nullptr;
+
+static void debug_history()
+{
+    char buf[256];
+    LogEntry entry;
+    for (int8_t age = DEBUG_HISTORY - 1; age >= 0; --age) {
+        if (log_history(age, entry)) {
+            log_format(entry, buf, sizeof(buf));
+            Debug.println(buf);
+        }
+    }
+}
+
+static void debug_command()
+{
+    String command = Debug.getLastCommand();
+    if (command == "log") {
+        debug_history();
+    } else if (debug_handler != nullptr) {
+        debug_handler(command.c_str());
+    }
+}
 
 void debug_setup()
 {
+    // Recursive, so console commands can print from inside Debug.handle()
+    debug_lock = xSemaphoreCreateRecursiveMutex();
     Debug.begin("shutter");
     Debug.setResetCmdEnabled(true);
+    String help = "log - Print the last events";
+    if (debug_help != nullptr) {
+        help += "\r\n";
+        help += debug_help;
+    }
+    Debug.setHelpProjectsCmds(help);
+    Debug.setCallBackProjectCmds(debug_command);
     printd("Debugger initialized");
 }
 
 void debug_handle()
 {
+    xSemaphoreTakeRecursive(debug_lock, portMAX_DELAY);
     Debug.handle();
+
+    // Format pending events only when someone is listening, and only report
+    // the events lost since then
+    static bool listening = false;
+    static uint32_t lost_reported = 0;
+    bool active = Debug.isActive(Debug.INFO);
+    if (active && !listening) {
+        lost_reported = log_lost();
+    }
+    listening = active;
+    if (active) {
+        char buf[256];
+        uint32_t lost = log_lost();
+        if (lost != lost_reported) {
+            snprintf(buf, sizeof(buf), "(%u events lost)", (unsigned)(lost - lost_reported));
+            Debug.println(buf);
+            lost_reported = lost;
+        }
+        LogEntry entry;
+        while (log_read(entry)) {
+            log_format(entry, buf, sizeof(buf));
+            Debug.println(buf);
+        }
+    }
+    xSemaphoreGiveRecursive(debug_lock);
 }
 
-void printd(const char *format, ...)
+// Must be called before debug_setup()
+void debug_set_commands(const char *help, void (*handler)(const char *command))
 {
-    char buf[512];
-    va_list ap;
+    debug_help = help;
+    debug_handler = handler;
+}
 
-    va_start(ap, format);
-    vsnprintf(buf, sizeof(buf), format, ap);
-    va_end(ap);
+void debug_println(const char *text)
+{
+    if (debug_lock == nullptr) {
+        return;
+    }
 
+    xSemaphoreTakeRecursive(debug_lock, portMAX_DELAY);
     if (Debug.isActive(Debug.INFO)) {
-        Debug.println(buf);
+        Debug.println(text);
     }
+    xSemaphoreGiveRecursive(debug_lock);
 }
\ No newline at end of file
@@ -1,5 +1,27 @@
 #pragma once
+#include <stdint.h>
+#include <type_traits>
+#include "log.h"
 
 void debug_setup();
 void debug_handle();
-void printd(const char *format, ...);
\ No newline at end of file
+void debug_set_commands(const char *help, void (*handler)(const char *command));
+void debug_println(const char *text); // Immediate, for console command output
+
+template <typename... Args>
+struct log_args_valid : std::true_type {};
+
+template <typename T, typename... Rest>
+struct log_args_valid<T, Rest...> : std::integral_constant<bool,
+    !std::is_floating_point<T>::value && log_args_valid<Rest...>::value> {};
+
+// Records the event in the log ring, it is formatted when a consumer reads
+// it. See LogEntry for the restrictions on the arguments.
+template <typename... Args>
+void printd(const char *format, Args... args)
+{
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "Too many log arguments");
+    static_assert(log_args_valid<Args...>::value, "Floating point log arguments are not supported");
+    const uintptr_t words[sizeof...(Args) + 1] = {(uintptr_t)args...};
+    log_write(format, words, sizeof...(Args));
+}
\ No newline at end of file
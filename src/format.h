@@ -0,0 +1,22 @@
+#pragma once
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Appends to a string built up from snprintf() calls, `n` being the result
+// so far. Once a part failed or was cut off, nothing more is written and `n`
+// comes back as is, so like with snprintf() a negative result or one of at
+// least `len` tells that the string is incomplete.
+inline int format_append(char *buf, size_t len, int n, const char *format, ...) __attribute__((format(printf, 4, 5)));
+
+inline int format_append(char *buf, size_t len, int n, const char *format, ...)
+{
+    if (n < 0 || (size_t)n >= len) {
+        return n;
+    }
+    va_list args;
+    va_start(args, format);
+    int part = vsnprintf(buf + n, len - n, format, args);
+    va_end(args);
+    return part < 0 ? part : n + part;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <Arduino.h>
+#include <soc/gpio_reg.h>
+#include "output.h"
+
+// Shadow of the internal GPIO outputs. Writes are collected and applied by
+// flush() with the set/clear registers, so any number of pins switch in
+// two register writes per bank.
+class GpioPort : public OutputRegister {
+private:
+    uint64_t _sent_output = 0;
+
+    static void writeBank(uint32_t clear_reg, uint32_t set_reg, uint32_t clear, uint32_t set) {
+        if (clear != 0) {
+            REG_WRITE(clear_reg, clear);
+        }
+        if (set != 0) {
+            REG_WRITE(set_reg, set);
+        }
+    }
+
+public:
+    // Pins in the mask become outputs, driven low
+    void begin(uint64_t pins) {
+        for (uint8_t pin = 0; pin < 64; ++pin) {
+            if (pins & (1ULL << pin)) {
+                ::pinMode(pin, OUTPUT);
+                ::digitalWrite(pin, LOW);
+            }
+        }
+        _reg_output = 0;
+        _sent_output = 0;
+    }
+
+    void digitalWrite(uint8_t pin, uint8_t value) {
+        write(1ULL << pin, value ? 1ULL << pin : 0);
+    }
+
+    uint8_t digitalRead(uint8_t pin) {
+        return ::digitalRead(pin);
+    }
+
+    // Pins turning off are cleared before the others are set
+    void flush() {
+        uint64_t changed = _reg_output ^ _sent_output;
+        if (changed == 0) {
+            return;
+        }
+        uint64_t clear = changed & _sent_output;
+        uint64_t set = changed & _reg_output;
+        writeBank(GPIO_OUT_W1TC_REG, GPIO_OUT_W1TS_REG, (uint32_t)clear, (uint32_t)set);
+        writeBank(GPIO_OUT1_W1TC_REG, GPIO_OUT1_W1TS_REG, (uint32_t)(clear >> 32), (uint32_t)(set >> 32));
+        _sent_output = _reg_output;
+    }
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include <Arduino.h>
+#include <Wire.h>
+#include "debug.h"
+
+// The Wire bus with recovery from a slave holding SDA low, which happens
+// when a transfer is cut short mid-byte: SCL is clocked until the slave lets
+// go, a STOP is issued and the driver restarted. No transfer can complete
+// while SDA is stuck, so retries alone never get out of it.
+class I2CBus {
+private:
+    static const uint8_t RECOVERY_CLOCKS = 9;
+    static const uint32_t RECOVERY_INTERVAL = 100;
+
+    uint8_t _sda;
+    uint8_t _scl;
+    uint32_t _clock = 100000;
+    uint16_t _timeout = 50;
+    uint32_t _recoveries = 0;
+    uint32_t _last_recovery = 0;
+
+    void start() {
+        Wire.begin(_sda, _scl);
+        Wire.setClock(_clock);
+        Wire.setTimeOut(_timeout);
+    }
+
+    void halfClock() {
+        delayMicroseconds(5);
+    }
+
+public:
+    I2CBus(uint8_t sda, uint8_t scl) : _sda(sda), _scl(scl) {}
+
+    void begin(uint32_t clock, uint16_t timeout) {
+        _clock = clock;
+        _timeout = timeout;
+        start();
+        if (Wire.getClock() != clock) {
+            printd("I2C clock is %u Hz instead of %u Hz", Wire.getClock(), clock);
+        }
+    }
+
+    bool isStuck() {
+        return ::digitalRead(_sda) == LOW;
+    }
+
+    // Call after failed transfers, recovers at most every RECOVERY_INTERVAL.
+    // Returns true when the bus was reset and devices must resend state.
+    bool handle() {
+        uint32_t time_current = millis();
+        if (!isStuck() || time_current - _last_recovery < RECOVERY_INTERVAL) {
+            return false;
+        }
+        _last_recovery = time_current;
+        _recoveries++;
+
+        Wire.end();
+        ::pinMode(_sda, INPUT_PULLUP);
+        ::pinMode(_scl, OUTPUT_OPEN_DRAIN);
+        ::digitalWrite(_scl, HIGH);
+        for (uint8_t i = 0; i < RECOVERY_CLOCKS && ::digitalRead(_sda) == LOW; ++i) {
+            ::digitalWrite(_scl, LOW);
+            halfClock();
+            ::digitalWrite(_scl, HIGH);
+            halfClock();
+        }
+
+        // STOP: SDA rising while SCL is high
+        ::pinMode(_sda, OUTPUT_OPEN_DRAIN);
+        ::digitalWrite(_sda, LOW);
+        halfClock();
+        ::digitalWrite(_sda, HIGH);
+        halfClock();
+        bool released = ::digitalRead(_sda) == HIGH;
+
+        start();
+        printd("I2C bus recovery %s", released ? "succeeded" : "failed");
+        return true;
+    }
+
+    uint32_t getClock() {return _clock;}
+    uint32_t getRecoveries() {return _recoveries;}
+};
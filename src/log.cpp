@@ -0,0 +1,69 @@
+#include "log.h"
+#include <Arduino.h>
+
+static LogEntry log_entries[LOG_SIZE];
+static uint32_t log_head = 0; // Total entries written
+static uint32_t log_tail = 0; // Total entries read
+static uint32_t log_overwritten = 0;
+static portMUX_TYPE log_mux = portMUX_INITIALIZER_UNLOCKED;
+
+void log_write(const char *format, const uintptr_t *args, uint8_t nargs)
+{
+    uint32_t timestamp = millis();
+
+    portENTER_CRITICAL(&log_mux);
+    LogEntry &entry = log_entries[log_head % LOG_SIZE];
+    entry.format = format;
+    entry.timestamp = timestamp;
+    entry.nargs = nargs;
+    for (uint8_t i = 0; i < nargs; ++i) {
+        entry.args[i] = args[i];
+    }
+    log_head++;
+    if (log_head - log_tail > LOG_SIZE) {
+        log_tail = log_head - LOG_SIZE;
+        log_overwritten++;
+    }
+    portEXIT_CRITICAL(&log_mux);
+}
+
+bool log_read(LogEntry &entry)
+{
+    bool found = false;
+    portENTER_CRITICAL(&log_mux);
+    if (log_tail != log_head) {
+        entry = log_entries[log_tail % LOG_SIZE];
+        log_tail++;
+        found = true;
+    }
+    portEXIT_CRITICAL(&log_mux);
+    return found;
+}
+
+bool log_history(uint8_t age, LogEntry &entry)
+{
+    bool found = false;
+    portENTER_CRITICAL(&log_mux);
+    if (age < LOG_SIZE && age < log_head) {
+        entry = log_entries[(log_head - 1 - age) % LOG_SIZE];
+        found = true;
+    }
+    portEXIT_CRITICAL(&log_mux);
+    return found;
+}
+
+uint32_t log_lost()
+{
+    return log_overwritten;
+}
+
+int log_format(const LogEntry &entry, char *buf, size_t len)
+{
+    int n = snprintf(buf, len, "[%u] ", (unsigned)entry.timestamp);
+    if (n < 0 || (size_t)n >= len) {
+        return n;
+    }
+    // Unused trailing arguments are ignored by snprintf()
+    const uintptr_t *a = entry.args;
+    return n + snprintf(buf + n, len - n, entry.format, a[0], a[1], a[2], a[3]);
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_MAX_ARGS 4
+#define LOG_SIZE     64 // Entries kept in RAM, the oldest is overwritten
+
+// A log event as recorded, formatting is deferred until it is read. The
+// format and any %s arguments must point to static strings, arguments must
+// fit in a machine word.
+struct LogEntry {
+    const char *format;
+    uint32_t timestamp;
+    uint8_t nargs;
+    uintptr_t args[LOG_MAX_ARGS];
+};
+
+// Safe from any task, costs a few stores
+void log_write(const char *format, const uintptr_t *args, uint8_t nargs);
+
+// Next entry not yet read by the consumer, false when there is none
+bool log_read(LogEntry &entry);
+
+// Entry `age` positions back from the newest one, regardless of reads
+bool log_history(uint8_t age, LogEntry &entry);
+
+// Entries overwritten before the consumer read them
+uint32_t log_lost();
+
+int log_format(const LogEntry &entry, char *buf, size_t len);
\ No newline at end of file
@@ -1,318 +1,406 @@
 #include <Arduino.h>
 #include <ArduinoOTA.h>
 #include <ESPmDNS.h>
-#include <vector>
 #include <WiFi.h>
 #include <WiFiUdp.h>
-#include <Wire.h>
-#include "button.h"
+#include "boot.h"
+#include "control.h"
 #include "debug.h"
+#include "format.h"
 #include "motor.h"
 #include "mqtt.h"
+#include "mqtt_parser.h"
 #include "ota.h"
-#include "pca9534.h"
-#include "relay.h"
-
-#define NUM_BUTTONS   20
-#define NUM_RELAYS    16
-#define NUM_MOTORS    8
-#define PORT_INTERNAL nullptr
-#define TIME_NORMAL   (33*1000)
-#define TIME_THIN     (37*1000)
-#define TIME_BIG      (73*1000)
+#include "profiler.h"
+#include "publisher.h"
+#include "store.h"
+#include "trace.h"
+#include "wifi.h"
+
+#define CORE_CONTROL  1
+#define CORE_NETWORK  0 // Same core as the WiFi stack
+#define TIME_PERF     (60*1000) // Profiler publish interval
+#define TIME_I2C      (1*1000)  // Bus health check interval
+#define TIME_LATENCY  (60*1000) // Command latency publish interval
 
 static void mqtt_callback(char* topic, byte* payload, unsigned int length);
-
-const std::vector<int> port_internal = {25, 26, 32, 33};
-PCA9534 port_out(0x20);
-PCA9534 port_mixed(0x22);
-PCA9534 port_in_a(0x21);
-PCA9534 port_in_b(0x24);
-
-const struct {
-    PCA9534 *up_port;
-    uint8_t up_pin;
-    PCA9534 *down_port;
-    uint8_t down_pin;
-    uint32_t timer;
-} config_motor[] {
-    [0] = {PORT_INTERNAL, 26, PORT_INTERNAL, 25, TIME_THIN},
-    [1] = {PORT_INTERNAL, 33, PORT_INTERNAL, 32, TIME_THIN},
-    [2] = {&port_mixed,    5, &port_mixed,    4, TIME_NORMAL},
-    [3] = {&port_mixed,    7, &port_mixed,    6, TIME_NORMAL},
-    [4] = {&port_out,      1, &port_out,      0, TIME_NORMAL},
-    [5] = {&port_out,      3, &port_out,      2, TIME_NORMAL},
-    [6] = {&port_out,      4, &port_out,      5, TIME_BIG},
-    [7] = {&port_out,      6, &port_out,      7, TIME_THIN},
-};
-
-const struct {
-    PCA9534 *port;
-    uint8_t pin;
-    uint8_t motor_id;
-    enum Motor::MotorStates direction;
-} config_button[] {
-    {&port_in_b,  7, 3, Motor::MotorStates::UP},   // Nappali ablak fel
-    {&port_in_b,  5, 3, Motor::MotorStates::DOWN}, // Nappali ablak le
-    {&port_mixed, 1, 1, Motor::MotorStates::UP},   // Nappali 1 fel
-    {&port_mixed, 3, 1, Motor::MotorStates::DOWN}, // Nappali 1 le
-    {&port_in_a,  1, 0, Motor::MotorStates::UP},   // Nappali 2 fel
-    {&port_in_a,  3, 0, Motor::MotorStates::DOWN}, // Nappali 2 le
-    {&port_in_a,  6, 7, Motor::MotorStates::UP},   // Nappali 3 fel
-    {&port_in_a,  4, 7, Motor::MotorStates::DOWN}, // Nappali 3 le
-    {&port_in_b,  1, 6, Motor::MotorStates::UP},   // Nappali ajtó fel
-    {&port_in_b,  3, 6, Motor::MotorStates::DOWN}, // Nappali ajtó le
-    {&port_in_b,  6, 6, Motor::MotorStates::UP},   // Nappali közös fel
-    {&port_in_b,  4, 6, Motor::MotorStates::DOWN}, // Nappali közös le
-    {&port_in_a,  7, 2, Motor::MotorStates::UP},   // Konyha fel
-    {&port_in_a,  5, 2, Motor::MotorStates::DOWN}, // Konyha le
-    {&port_in_b,  2, 2, Motor::MotorStates::UP},   // Bejárat fel
-    {&port_in_b,  0, 2, Motor::MotorStates::DOWN}, // Bejárat le
-    {&port_mixed, 0, 4, Motor::MotorStates::UP},   // Dolgozó fel
-    {&port_mixed, 2, 4, Motor::MotorStates::DOWN}, // Dolgozó le
-    {&port_in_a,  0, 5, Motor::MotorStates::UP},   // Vendég fel 
-    {&port_in_a,  2, 5, Motor::MotorStates::DOWN}, // Vendég le
-};
+static void control_task(void *arg);
+static void network_task(void *arg);
+static void console_command(const char *command);
+
+// Help for the commands handled by console_command()
+static const char console_help[] =
+    "boot - Print boot phase times\r\n"
+    "i2c - Print bus traffic and health per expander\r\n"
+    "latency - Print command latencies per origin\r\n"
+    "mqtt - Print broker connection statistics\r\n"
+    "queue - Print command queue statistics and the next deadline"
+#ifdef PROFILER
+    "\r\nperf - Print loop stage latencies"
+#endif
+    ;
 
 #error "Please set the SSID and password"
 const char* ssid = "";
 const char* password = "";
+// Optional static address, skips DHCP
+// #define WIFI_STATIC_IP 192, 168, 0, 50
+// #define WIFI_GATEWAY   192, 168, 0, 1
+// #define WIFI_SUBNET    255, 255, 255, 0
 
 Upgrade upgrader;
 Mqtt mqtt;
+StatePublisher state_publisher;
+StateStore state_store;
+Wireless wireless;
 bool wifi_is_connected = false;
+bool mqtt_was_connected = false;
+uint32_t i2c_last_check = 0;
+uint32_t i2c_faults_published = 0;
+LatencyWindow<64> latency[NUM_ORIGINS][NUM_TRACE_HOPS]; // us since received
+uint32_t latency_last_publish = 0;
+
+#ifdef PROFILER
+// Stages of network_task() for the profiler
+enum NetworkStage : uint8_t {
+    STAGE_WIFI,
+    STAGE_OTA,
+    STAGE_MQTT,
+    STAGE_REPORT,
+    STAGE_DEBUG,
+    STAGE_NETWORK, // Whole pass
+    NUM_NETWORK_STAGES,
+};
+static const char *const network_stage_names[] = {
+    "wifi", "ota", "mqtt", "report", "debug", "network",
+};
+Profiler<NUM_NETWORK_STAGES> network_profiler(network_stage_names);
+uint32_t perf_last_publish = 0;
+#endif
 
-Motor motors[NUM_MOTORS];
-Button buttons[NUM_BUTTONS];
-
+// Local control comes up first, networking starts in its own task
 void setup() {
+    boot_mark(BOOT_SETUP);
+
     // Configure serial
     Serial.begin(115200);
 
-    // Configure I2C
-    Wire.begin();
+    // Configure motors and buttons, the expanders are ready well before
+    // setup() runs and the periodic resync covers a slow one
+    control_setup();
+    state_store.begin();
+    boot_mark(BOOT_CONTROL);
+    xTaskCreatePinnedToCore(control_task, "control", 4096, nullptr, 20, nullptr, CORE_CONTROL);
 
-    // Configure WiFi
-    WiFi.mode(WIFI_STA);
-    WiFi.begin(ssid, password);
+    // Console commands
+    debug_set_commands(console_help, console_command);
 
-    // Configure MQTT
-    mqtt.setCallback(mqtt_callback);
+    xTaskCreatePinnedToCore(network_task, "network", 8192, nullptr, 1, nullptr, CORE_NETWORK);
 
-    // Setup OTA
-    upgrader.setup();
+    // Ready
+    Serial.println("Setup done");
+}
 
-    // Wait for peripherals
-    sleep(1);
+void loop() {
+    // All work happens in the control and network tasks
+    vTaskDelete(nullptr);
+}
 
-    // Configure pins
-    for (const int& i : port_internal) {
-        pinMode(i, OUTPUT);
-        digitalWrite(i, LOW);
-    }
-    
-    port_out.begin();
-    port_out.configure(0x00);
-
-    port_mixed.begin();
-    port_mixed.configure(0x0f);
-
-    port_in_a.begin();
-    port_in_a.configure(0xff);
-    
-    port_in_b.begin();
-    port_in_b.configure(0xff);
-
-    // Configure motors
-    for (uint8_t i = 0; i < NUM_MOTORS; ++i) {
-        motors[i].begin(
-            i,
-            Relay(config_motor[i].up_port, config_motor[i].up_pin),
-            Relay(config_motor[i].down_port, config_motor[i].down_pin)
-        );
+static void control_task(void *arg)
+{
+    TickType_t last_wake = xTaskGetTickCount();
+    control_tick();
+    boot_mark(BOOT_TICK);
+    for (;;) {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(TIME_TICK));
+        control_tick();
     }
+}
 
-    // Configure buttons
-    for (uint8_t i = 0; i < NUM_BUTTONS; ++i) {
-        buttons[i].begin(i);
-
-        uint8_t motor_id = config_button[i].motor_id;
-        Motor::MotorStates direction = config_button[i].direction;
-        uint32_t motor_timer = config_motor[motor_id].timer;
-
-        buttons[i].onPress([=](uint8_t button){
-            motors[motor_id].toggle(direction);
-        });
-
-        buttons[i].onShort([=](uint8_t button){
-            if (motors[motor_id].getState() != Motor::MotorStates::OFF) {
-                motors[motor_id].timer_set(motor_timer);
-            }
-        });
-
-        buttons[i].onLong([=](uint8_t button){
-            motors[motor_id].off();
-        });
+// Acknowledgement of one command with the state of its motors and its trace
+// id, so the sender can match its round trip
+static void mqtt_acknowledge(uint8_t report, uint16_t trace)
+{
+    ControlSnapshot state = control_snapshot();
+    char resp[NUM_MOTORS * 8 + 8];
+    size_t length = 0;
+    for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+        if ((report & (1 << m)) == 0) {
+            continue;
+        }
+
+        const char *symbol;
+        switch (state.motor_state[m]) {
+            case Motor::MotorStates::UP:
+                symbol = "↑";
+                break;
+            case Motor::MotorStates::DOWN:
+                symbol = "↓";
+                break;
+            default: // Off, or a start held back
+                if (state.motor_pending[m] == Motor::MotorStates::UP) {
+                    symbol = "⇡";
+                } else if (state.motor_pending[m] == Motor::MotorStates::DOWN) {
+                    symbol = "⇣";
+                } else {
+                    symbol = "x";
+                }
+                break;
+        }
+        length += snprintf(resp + length, sizeof(resp) - length, "{%u}%s", m, symbol);
     }
+    snprintf(resp + length, sizeof(resp) - length, " #%u", trace);
+    mqtt.publish("stat/shutter/state", resp);
+}
 
-    // Configure special buttons
-    for (uint8_t i = 10; i < 12; ++i) {
-        Motor::MotorStates direction = config_button[i].direction;
-
-        buttons[i].onPress([=](uint8_t button){
-            for (const int& m : {0, 1, 3, 6, 7}) {
-                motors[m].toggle(direction);
-            }
-        });
+// Acknowledges each MQTT command applied since the last pass and records the
+// latencies of every command applied
+static void mqtt_report()
+{
+    CommandTrace trace;
+    for (uint8_t i = 0; i < NUM_TRACES && control_take_trace(trace); ++i) {
+        uint8_t last = trace.written ? HOP_WRITTEN : HOP_SCHEDULED;
+        for (uint8_t hop = HOP_PARSED; hop <= last; ++hop) {
+            latency[trace.origin][hop].add(trace.hop[hop] - trace.received);
+        }
+        if (trace.report != 0) {
+            mqtt_acknowledge(trace.report, trace.id);
+            latency[trace.origin][HOP_PUBLISHED].add(micros() - trace.received);
+        }
+    }
+}
 
-        buttons[i].onShort([=](uint8_t button){
-            for (const int& m : {0, 1, 3, 6, 7}) {
-                if (motors[m].getState() != Motor::MotorStates::OFF) {
-                    motors[m].timer_set(config_motor[m].timer);
-                }
-            }
-        });
+// Latencies of the commands of one origin as JSON
+static int latency_format(uint8_t origin, char *buf, size_t len)
+{
+    static const char *const origin_names[NUM_ORIGINS] = {"button", "mqtt", "system"};
+    static const char *const hop_names[NUM_TRACE_HOPS] = {"parsed", "scheduled", "written", "published"};
+    int n = snprintf(buf, len, "{\"origin\":\"%s\",\"n\":%u", origin_names[origin], (unsigned)latency[origin][HOP_PARSED].getCount());
+    for (uint8_t hop = 0; hop < NUM_TRACE_HOPS; ++hop) {
+        n = format_append(buf, len, n, ",\"%s_us\":", hop_names[hop]);
+        n = latency[origin][hop].format(buf, len, n);
+    }
+    return format_append(buf, len, n, "}");
+}
 
-        buttons[i].onLong([=](uint8_t button){
-            for (const int& m : {0, 1, 3, 6, 7}) {
-                motors[m].off();
-            }
-        });
+// Publishes p50/p99/max per origin and hop over the recent commands
+static void latency_handle()
+{
+    uint32_t time_current = millis();
+    if (time_current - latency_last_publish < TIME_LATENCY) {
+        return;
+    }
+    latency_last_publish = time_current;
+    char buf[256];
+    for (uint8_t origin = 0; origin < NUM_ORIGINS; ++origin) {
+        if (latency[origin][HOP_PARSED].getCount() != 0) {
+            latency_format(origin, buf, sizeof(buf));
+            mqtt.publish("stat/shutter/latency", buf);
+        }
     }
+}
 
-    for (uint8_t i = 14; i < 15; ++i) {
-        Motor::MotorStates direction = config_button[i].direction;
+#ifdef PROFILER
+template <uint8_t NumStages>
+static void perf_print(Profiler<NumStages> &profiler)
+{
+    char buf[192];
+    for (uint8_t i = 0; i < profiler.size(); ++i) {
+        profiler.format(i, buf, sizeof(buf));
+        debug_println(buf);
+    }
+}
 
-        buttons[i].onPress([=](uint8_t button){
-            for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
-                motors[m].toggle(direction);
-            }
-        });
 
-        buttons[i].onShort([=](uint8_t button){
-            for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
-                if (motors[m].getState() != Motor::MotorStates::OFF) {
-                    motors[m].timer_set(config_motor[m].timer);
-                }
-            }
-        });
-
-        buttons[i].onLong([=](uint8_t button){
-            for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
-                motors[m].off();
-            }
-        });
+template <uint8_t NumStages>
+static void perf_publish(Profiler<NumStages> &profiler)
+{
+    char buf[192];
+    for (uint8_t i = 0; i < profiler.size(); ++i) {
+        profiler.format(i, buf, sizeof(buf));
+        mqtt.publish("stat/shutter/perf", buf);
     }
+}
 
-    // Ready
-    Serial.println("Setup done");
+static void perf_handle()
+{
+    uint32_t time_current = millis();
+    if (time_current - perf_last_publish < TIME_PERF) {
+        return;
+    }
+    perf_last_publish = time_current;
+    perf_publish(control_profiler);
+    perf_publish(network_profiler);
 }
+#endif
 
-void loop() {
-    // Handle WiFi
-    if (!wifi_is_connected && WiFi.isConnected()) {
-        wifi_is_connected = true;
-        Serial.print("WiFi connected, IP = ");
-        Serial.println(WiFi.localIP());
-        debug_setup();
+// Reboots into the new firmware once the OTA task completed an upload, after
+// reporting the transfer and saving the motor state
+static void ota_handle()
+{
+    if (!upgrader.isRebootPending()) {
+        return;
+    }
+    char buf[128];
+    upgrader.format(buf, sizeof(buf));
+    mqtt.publish("stat/shutter/ota", buf);
+    state_store.commit();
+    uint32_t time_begin = millis();
+    while (mqtt.queued() > 0 && millis() - time_begin < 500) {
+        mqtt.handle();
+        delay(5);
     }
+    ESP.restart();
+}
 
-    if (wifi_is_connected) {
-        upgrader.handle(); // Handle OTA
-        mqtt.handle();     // Handle MQTT
-        debug_handle();    // Handle telnet debug
+// Publishes the bus health whenever new errors or recoveries happened
+static void i2c_handle()
+{
+    uint32_t time_current = millis();
+    if (time_current - i2c_last_check < TIME_I2C) {
+        return;
     }
+    i2c_last_check = time_current;
 
-    // Handle buttons
-    for (uint8_t i = 0; i < NUM_BUTTONS; ++i) {
-        uint8_t value = config_button[i].port->digitalRead(config_button[i].pin);
-        buttons[i].new_value(value);
+    uint32_t faults = control_i2c_faults();
+    if (faults == i2c_faults_published) {
+        return;
     }
+    char buf[256];
+    control_format_i2c(buf, sizeof(buf));
+    mqtt.publish("stat/shutter/i2c", buf);
+    i2c_faults_published = faults;
+}
 
-    // Handle motors
-    for (uint8_t i = 0; i < NUM_MOTORS; ++i) {
-        motors[i].timer_handle();
+static void console_command(const char *command)
+{
+    if (strcmp(command, "boot") == 0) {
+        char buf[128];
+        boot_format(buf, sizeof(buf));
+        debug_println(buf);
+    }
+    if (strcmp(command, "mqtt") == 0) {
+        char buf[128];
+        mqtt.format(buf, sizeof(buf));
+        debug_println(buf);
+    }
+    if (strcmp(command, "i2c") == 0) {
+        char buf[256];
+        control_format_i2c(buf, sizeof(buf));
+        debug_println(buf);
+    }
+    if (strcmp(command, "queue") == 0) {
+        char buf[128];
+        control_format_queue(buf, sizeof(buf));
+        debug_println(buf);
     }
+    if (strcmp(command, "latency") == 0) {
+        char buf[256];
+        for (uint8_t origin = 0; origin < NUM_ORIGINS; ++origin) {
+            latency_format(origin, buf, sizeof(buf));
+            debug_println(buf);
+        }
+    }
+#ifdef PROFILER
+    if (strcmp(command, "perf") == 0) {
+        perf_print(control_profiler);
+        perf_print(network_profiler);
+    }
+#endif
+}
 
-    // Handle port expanders
-    port_mixed.handle();
-    port_in_a.handle();
-    port_in_b.handle();
-    port_out.handle();
+static void network_task(void *arg)
+{
+    // Start the radio, the connection completes in the background
+#ifdef WIFI_STATIC_IP
+    wireless.setStaticIP(IPAddress(WIFI_STATIC_IP), IPAddress(WIFI_GATEWAY), IPAddress(WIFI_SUBNET));
+#endif
+    wireless.begin(ssid, password);
+    mqtt.setCallback(mqtt_callback);
+    upgrader.setup();
+    upgrader.begin(CORE_NETWORK);
+
+    for (;;) {
+        PROFILE_BEGIN(network_profiler);
+
+        // Handle WiFi
+        if (wireless.handle() && !wifi_is_connected) {
+            wifi_is_connected = true;
+            Serial.print("WiFi connected, IP = ");
+            Serial.println(WiFi.localIP());
+            debug_setup();
+        }
+        PROFILE_MARK(network_profiler, STAGE_WIFI);
+
+        if (wifi_is_connected) {
+            ota_handle();      // Reboot after an update
+            PROFILE_MARK(network_profiler, STAGE_OTA);
+            mqtt.handle();     // Handle MQTT
+            if (mqtt.connected() && !mqtt_was_connected) {
+                boot_mark(BOOT_MQTT);
+                char buf[128];
+                boot_format(buf, sizeof(buf));
+                mqtt.publish("stat/shutter/boot", buf);
+            }
+            mqtt_was_connected = mqtt.connected();
+            PROFILE_MARK(network_profiler, STAGE_MQTT);
+            mqtt_report();     // Respond to applied commands
+            state_publisher.handle(mqtt); // Publish state changes
+            i2c_handle();      // Publish bus errors
+            latency_handle();  // Publish command latencies
+            PROFILE_MARK(network_profiler, STAGE_REPORT);
+            debug_handle();    // Handle telnet debug
+            PROFILE_MARK(network_profiler, STAGE_DEBUG);
+            PROFILE_END(network_profiler, STAGE_NETWORK);
+#ifdef PROFILER
+            perf_handle();     // Publish stage latencies
+#endif
+        }
+
+        state_store.handle(); // Persist state once motors stop
+
+        vTaskDelay(1);
+    }
 }
 
 
 void mqtt_callback(char* topic, byte* payload, unsigned int length)
 {
-    // Convert payload
-    char buf[512];
-    int i;
-    for (i = 0; i < length; i++) {
-        buf[i] = payload[i];
-    }
-    buf[i] = '\0';
-
-    long int channel = strtol(buf, nullptr, 10);
-
-    // Convert topic to direction
-    Motor::MotorStates direction;
-    if (strncmp(topic, "cmnd/shutter/up", 15) == 0) {
-        direction = Motor::MotorStates::UP;
-    } else if (strncmp(topic, "cmnd/shutter/down", 15) == 0) {
-        direction = Motor::MotorStates::DOWN;
-    } else {
-        direction = Motor::MotorStates::OFF;
-    }
-
-    // Print received message
-    String recv = "MQTT received: Motor {";
-    recv += channel;
-    recv += "} command ";
-    switch (direction) {
-        case Motor::MotorStates::UP:
-            recv += "UP";
-            break;
-        case Motor::MotorStates::DOWN:
-            recv += "DOWN";
+    uint32_t received = micros();
+    MqttCommand command;
+    switch (mqtt_parse(topic, payload, length, command)) {
+        case PARSE_OK:
             break;
-        default: // OFF
-            printd("MQTT received command OFF");
-            for (uint8_t i = 0; i < NUM_MOTORS; ++i) {
-                motors[i].off();
-            }
-            mqtt.publish("stat/shutter/state", "All off");
+        case PARSE_BAD_PAYLOAD:
+            printd("MQTT command with invalid payload");
+            return;
+        case PARSE_BAD_MOTOR:
+            printd("MQTT command for motor out of range");
+            return;
+        default: // PARSE_UNKNOWN_TOPIC
+            printd("MQTT unknown topic");
             return;
-            break;
     }
-    printd(recv.c_str());
 
-    // Sanity check
-    if (channel >= NUM_MOTORS) {
-        printd("MQTT command for motor {%d} out of range", channel);
+    const MqttVerb &verb = *command.verb;
+    if (verb.type == MotorCommand::BULK) {
+        printd("MQTT received: Bulk command for motors 0x%02x", command.bulk.mask);
+        command_push_bulk(command.bulk, ORIGIN_MQTT, received);
         return;
     }
-
-    // Execute command
-    uint32_t motor_timer = config_motor[channel].timer;
-    motors[channel].toggle(direction);
-    if (motors[channel].getState() != Motor::MotorStates::OFF) {
-        motors[channel].timer_set(motor_timer);
+    if (command.motor == MOTOR_ALL) {
+        printd("MQTT received: All motors command %s", verb.name);
+        command_push(verb.type, MOTOR_ALL, verb.direction, 0, ORIGIN_MQTT, received);
+        return;
     }
+    printd("MQTT received: Motor {%d} command %s", command.motor, verb.name);
 
-    // Respond
-    String resp = "{";
-    resp += channel;
-    resp += "}";
-    switch (motors[channel].getState()) {
-        case Motor::MotorStates::UP:
-            resp += "↑";
-            break;
-        case Motor::MotorStates::DOWN:
-            resp += "↓";
-            break;
-        default:
-            resp += "x";
-            break;
+    if (verb.type == MotorCommand::POSITION) {
+        command_push(MotorCommand::POSITION, command.motor, Motor::MotorStates::OFF, command.position, ORIGIN_MQTT, received);
+        return;
     }
-    mqtt.publish("stat/shutter/state", resp.c_str());
+
+    // Execute command, the control task responds once it is applied
+    uint32_t motor_timer = (verb.type == MotorCommand::TOGGLE) ? control_travel_time(command.motor) : 0;
+    command_push(verb.type, command.motor, verb.direction, motor_timer, ORIGIN_MQTT, received);
 }
\ No newline at end of file
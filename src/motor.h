@@ -2,6 +2,12 @@
 #include <Arduino.h>
 #include "debug.h"
 #include "relay.h"
+#include "starter.h"
+#include "timers.h"
+
+// Position of a shutter in per mille of its travel, 0 is fully down
+#define POSITION_MAX     1000
+#define POSITION_UNKNOWN 0xffff
 
 class Motor {
 public:
@@ -13,48 +19,219 @@ public:
 
 private:
     uint8_t id;
-    Relay relay_up;
-    Relay relay_down;
-    bool timer_running = false;
-    uint32_t timer_time = 0;
-    uint32_t timer_time_start = 0;
+    RelayInterlock relays; // FIRST is up, SECOND down
+    Timers *timers = nullptr;
+    Timers::Handle timer = Timers::INVALID; // Stop timer, or the dead time while a start is pending
     MotorStates state = OFF;
 
+    // A start waits for the dead time after running the other way, then for
+    // the supply budget. Its stop timer only runs from the actual start.
+    Starter *starter = nullptr;
+    uint8_t supply = 0;
+    uint32_t dead_time = 0;
+    MotorStates pending = OFF;
+    uint32_t pending_ms = 0;
+    MotorStates last_direction = OFF;
+    uint32_t stopped_at = 0;
+
+    // Position estimate, integrated from the run time in each direction and
+    // recalibrated at the end stop after every run of a full travel time
+    uint32_t time_up = 0;
+    uint32_t time_down = 0;
+    uint16_t position_start = POSITION_UNKNOWN; // At run_start
+    uint32_t run_start = 0;
+    uint16_t calibrating_for = POSITION_UNKNOWN; // Target after the run to an end stop
+
+    // Wear counters
+    uint32_t runs = 0;
+    uint32_t run_seconds = 0;
+    uint16_t run_ms = 0;
+
+    uint16_t estimate(uint32_t now) {
+        if (state == OFF || position_start == POSITION_UNKNOWN) {
+            return position_start;
+        }
+        uint32_t elapsed = now - run_start;
+        if (state == UP) {
+            if (elapsed >= time_up) {
+                return POSITION_MAX;
+            }
+            uint32_t delta = elapsed * POSITION_MAX / time_up;
+            return delta >= (uint32_t)(POSITION_MAX - position_start) ? POSITION_MAX : position_start + delta;
+        }
+        if (elapsed >= time_down) {
+            return 0;
+        }
+        uint32_t delta = elapsed * POSITION_MAX / time_down;
+        return delta >= position_start ? 0 : position_start - delta;
+    }
+
+    // Folds the run so far into position_start, before every state change
+    void track() {
+        uint32_t now = millis();
+        uint32_t elapsed = now - run_start;
+        if (state != OFF) {
+            uint32_t ms = run_ms + elapsed;
+            run_seconds += ms / 1000;
+            run_ms = ms % 1000;
+        }
+        if (state == UP && elapsed >= time_up) {
+            position_start = POSITION_MAX;
+        } else if (state == DOWN && elapsed >= time_down) {
+            position_start = 0;
+        } else {
+            position_start = estimate(now);
+        }
+        run_start = now;
+    }
+
+    static void timer_expired(void *arg) {
+        Motor *motor = static_cast<Motor*>(arg);
+        if (motor->pending != OFF) { // Dead time over
+            motor->request_start();
+            return;
+        }
+        printd("Motor {%d} timer elapsed", motor->id);
+        uint16_t target = motor->calibrating_for;
+        motor->off();
+        if (target != POSITION_UNKNOWN) { // At the end stop, the position is known now
+            motor->moveTo(target);
+        }
+    }
+
+    static void start_granted(void *arg) {
+        static_cast<Motor*>(arg)->run();
+    }
+
+    // Starts the pending direction
+    void run() {
+        MotorStates direction = pending;
+        pending = OFF;
+        track();
+        runs++;
+        relays.select(direction == UP ? RelayInterlock::FIRST : RelayInterlock::SECOND);
+        state = direction;
+        printd("Motor {%d} going %s", id, direction == UP ? "up" : "down");
+        if (pending_ms != 0) {
+            timer_set(pending_ms);
+            pending_ms = 0;
+        }
+    }
+
+    void stop() {
+        if (state == OFF) {
+            return;
+        }
+        track();
+        relays.select(RelayInterlock::NONE);
+        last_direction = state;
+        stopped_at = millis();
+        state = OFF;
+    }
+
+    void request_start() {
+        if (starter->request(supply, millis(), start_granted, this)) {
+            run();
+        } else {
+            printd("Motor {%d} start delayed by the supply budget", id);
+        }
+    }
+
+    void cancel_start() {
+        if (pending == OFF) {
+            return;
+        }
+        starter->cancel(this);
+        timers->cancel(timer);
+        pending = OFF;
+    }
+
+    // Reversing stops the motor and only energises the other relay after the
+    // dead time, then every start from rest waits for the supply budget.
+    // A newer request replaces a pending one.
+    void start(MotorStates direction) {
+        calibrating_for = POSITION_UNKNOWN;
+        if (state == direction) {
+            printd("Motor {%d} already going %s", id, direction == UP ? "up" : "down");
+            return;
+        }
+        if (pending == direction) {
+            return; // Keeps its place in the queue
+        }
+        cancel_start();
+        stop();
+        timers->cancel(timer); // The caller arms the stop timer for the new run
+        pending = direction;
+        pending_ms = 0;
+
+        uint32_t since_stop = millis() - stopped_at;
+        if (last_direction != OFF && last_direction != direction && since_stop < dead_time) {
+            timers->start(timer, millis(), dead_time - since_stop);
+            printd("Motor {%d} reversing in %lu ms", id, dead_time - since_stop);
+            return;
+        }
+        request_start();
+    }
+
 public:
     Motor(){}
 
-    void begin(uint8_t id, Relay relay_up, Relay relay_down) {
-        this->relay_up = relay_up;
-        this->relay_down = relay_down;
+    void begin(uint8_t id, RelayInterlock relays, uint32_t time_up, uint32_t time_down, Timers *timers,
+               Starter *starter, uint8_t supply) {
+        this->relays = relays;
         this->id= id;
+        this->time_up = time_up;
+        this->time_down = time_down;
+        this->timers = timers;
+        this->timer = timers->create(timer_expired, this);
+        if (this->timer == Timers::INVALID) {
+            printd("Motor {%d} has no timer, out of timers", id);
+        }
+        this->starter = starter;
+        this->supply = supply;
+    }
+
+    // Time with both relays off before running the other way
+    void setDeadTime(uint32_t ms) {
+        this->dead_time = ms;
     }
 
     uint8_t getId() {return this->id;}
+    bool isReachable() {return relays.isReachable();}
     enum MotorStates getState() {return this->state;}
+    // Direction of a start held back by the dead time or the supply budget
+    enum MotorStates getPending() {return this->pending;}
+    // Running or waiting for the dead time or the supply budget to start
+    bool isActive() {return state != OFF || pending != OFF;}
+
+    // Per mille of the travel, POSITION_UNKNOWN until the first full travel
+    uint16_t getPosition() {return estimate(millis());}
+    uint32_t getRuns() {return runs;}
+    uint32_t getRunTime() {return run_seconds;}
+
+    // State saved before a reboot, only while stopped
+    void restore(uint16_t position, uint32_t runs, uint32_t run_seconds) {
+        if (state != OFF) {
+            return;
+        }
+        this->position_start = position > POSITION_MAX ? POSITION_UNKNOWN : position;
+        this->runs = runs;
+        this->run_seconds = run_seconds;
+    }
 
     void off() {
-        relay_down.off();
-        relay_up.off();
-        state = OFF;
-        if (timer_running == true) {
+        calibrating_for = POSITION_UNKNOWN;
+        cancel_start();
+        stop();
+        relays.select(RelayInterlock::NONE); // Also when already off, to resend
+        if (timers->active(timer) || pending_ms != 0) {
             timer_cancel();
         }
         printd("Motor {%d} stopped", id);
     }
 
-    void up() {
-        relay_down.off();
-        relay_up.on();
-        state = UP;
-        printd("Motor {%d} going up", id);
-    }
-
-    void down() {
-        relay_up.off();
-        relay_down.on();
-        state = DOWN;
-        printd("Motor {%d} going down", id);
-    }
+    void up() {start(UP);}
+    void down() {start(DOWN);}
 
     void set(enum MotorStates direction) {
         switch (direction) {
@@ -71,7 +248,7 @@ public:
     }
 
     void toggle(enum MotorStates direction) {
-        if (this->state == OFF) {
+        if (!isActive()) {
             set(direction);
         } else { // UP or DOWN
             off();
@@ -79,42 +256,73 @@ public:
         }
     }
 
-    enum MotorStates get() {
-        uint8_t state_up = relay_up.get();
-        uint8_t state_down = relay_down.get();
-        if (state_up == LOW && state_down == LOW) {
-            return Motor::MotorStates::OFF;
-        } else if (state_up == LOW && state_down == HIGH) {
-            return Motor::MotorStates::DOWN;
-        } else if (state_up == HIGH && state_down == LOW) {
-            return Motor::MotorStates::UP;
-        } else { // both HIGH
-            printd("Error: Both relays on for motor with id %d", getId());
-            return Motor::MotorStates::OFF;
+    // Runs for the time needed to reach a position. The ends always run the
+    // full travel time, which recalibrates the estimate against the end stop.
+    // While the position is unknown, any other target first runs to the
+    // nearer end stop and from there to the target.
+    void moveTo(uint16_t target) {
+        uint16_t position = getPosition();
+        uint16_t calibrate = POSITION_UNKNOWN;
+        MotorStates direction;
+        uint32_t ms;
+        if (target >= POSITION_MAX) {
+            direction = UP;
+            ms = time_up;
+        } else if (target == 0) {
+            direction = DOWN;
+            ms = time_down;
+        } else if (position == POSITION_UNKNOWN) {
+            printd("Motor {%d} position unknown, calibrating", id);
+            direction = target < POSITION_MAX / 2 ? DOWN : UP;
+            ms = direction == DOWN ? time_down : time_up;
+            calibrate = target;
+        } else if (target > position) {
+            direction = UP;
+            ms = (uint32_t)(target - position) * time_up / POSITION_MAX;
+        } else {
+            direction = DOWN;
+            ms = (uint32_t)(position - target) * time_down / POSITION_MAX;
         }
-    }
 
-    void timer_set(uint32_t ms) {
-        timer_time = ms;
-        timer_time_start = millis();
-        timer_running = true;
-        printd("Motor {%d} timer set to %lu ms", id, timer_time);
+        if (ms == 0) {
+            off();
+            return;
+        }
+        if (state != direction) {
+            set(direction);
+        }
+        calibrating_for = calibrate;
+        timer_set(ms);
     }
 
-    void timer_cancel() {
-        timer_running = false;
-        printd("Motor {%d} timer cancelled", id);
+    // The direction the relays are set to
+    enum MotorStates get() {
+        switch (relays.get()) {
+            case RelayInterlock::FIRST:
+                return Motor::MotorStates::UP;
+            case RelayInterlock::SECOND:
+                return Motor::MotorStates::DOWN;
+            default:
+                return Motor::MotorStates::OFF;
+        }
     }
 
-    void timer_handle() {
-        if (timer_running == false) {
+    // Counts from the actual start when the start is still waiting
+    void timer_set(uint32_t ms) {
+        if (pending != OFF) {
+            pending_ms = ms;
+            printd("Motor {%d} timer set to %lu ms from its start", id, ms);
             return;
         }
+        timers->start(timer, millis(), ms);
+        printd("Motor {%d} timer set to %lu ms", id, ms);
+    }
 
-        uint32_t time_current = millis();
-        if (time_current - timer_time_start >= timer_time) {
-            printd("Motor {%d} timer elapsed", id);
-            off();
+    void timer_cancel() {
+        pending_ms = 0;
+        if (pending == OFF) { // Otherwise it times the dead time
+            timers->cancel(timer);
         }
+        printd("Motor {%d} timer cancelled", id);
     }
 };
\ No newline at end of file
@@ -1,55 +1,475 @@
 #pragma once
-#include <WiFi.h>
-#include <PubSubClient.h>
+#include <Arduino.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <lwip/sockets.h>
+#include <string.h>
+#include <unistd.h>
 #include "debug.h"
 
+#define MQTT_RX_SIZE    512  // Largest incoming packet
+#define MQTT_TX_SIZE    2048 // Outbound queue of encoded packets
+#define MQTT_TX_PACKETS 32
+#define MQTT_KEEPALIVE  15   // s
+
+// MQTT 3.1.1 client for QoS 0 on a non-blocking socket. handle() never waits
+// on the network: the TCP connect and the CONNECT handshake run as a state
+// machine with timeouts, failed attempts back off exponentially, and
+// publish() only encodes the packet into a bounded queue which handle()
+// sends as far as the socket accepts it. When the queue is full, the oldest
+// packets are dropped, as fresh state is worth more than stale state.
 class Mqtt {
+public:
+    typedef void (*Callback)(char *topic, uint8_t *payload, unsigned int length);
+
 private:
-    String clientId = "shutter";
-    String broker = "192.168.0.1";
-    int broker_port = 1883;
-    WiFiClient wifi_client;
-    PubSubClient client{wifi_client};
-    uint32_t last_connection_trial = 0;
-    char buffer[512];
-
-    void reconnect_if_needed() {
-        if (!client.connected()) {
-            uint32_t current_time = millis();
-            if (current_time - last_connection_trial < 5000) {
+    enum State : uint8_t {
+        IDLE,       // Waiting for the next attempt
+        CONNECTING, // TCP connect in progress
+        HANDSHAKE,  // CONNECT sent, waiting for CONNACK
+        CONNECTED,
+    };
+
+    enum PacketType : uint8_t {
+        CONNECT = 0x10,
+        CONNACK = 0x20,
+        PUBLISH = 0x30,
+        SUBSCRIBE = 0x82,
+        SUBACK = 0x90,
+        PINGREQ = 0xc0,
+        PINGRESP = 0xd0,
+    };
+
+    static const uint32_t TIMEOUT = 3000; // For each of the TCP connect and the handshake
+    static const uint32_t BACKOFF_MIN = 500;
+    static const uint32_t BACKOFF_MAX = 60000;
+
+    const char *client_id = "shutter";
+    const char *broker = "192.168.0.1";
+    uint16_t broker_port = 1883;
+    Callback callback = nullptr;
+
+    int fd = -1;
+    State state = IDLE;
+    uint32_t time_state = 0; // When the current state was entered
+    uint32_t backoff = 0;    // Before the next attempt
+    uint32_t last_in = 0;
+    uint32_t last_out = 0;
+    bool ping_outstanding = false;
+
+    // Incoming packet being assembled
+    uint8_t rx[MQTT_RX_SIZE];
+    uint16_t rx_length = 0;
+    uint32_t rx_skip = 0; // Remainder of an oversized packet
+
+    // Ring of encoded packets, sent as one byte stream
+    uint8_t tx[MQTT_TX_SIZE];
+    uint16_t tx_tail = 0; // Next byte to send
+    uint16_t tx_used = 0;
+    uint16_t tx_sizes[MQTT_TX_PACKETS]; // Queued packets, oldest first
+    uint8_t tx_first = 0;
+    uint8_t tx_count = 0;
+    uint16_t tx_sent = 0; // Bytes of the oldest packet already sent
+
+    uint32_t connects = 0;
+    uint32_t failures = 0;
+    uint32_t dropped = 0;
+
+    void enter(State next) {
+        state = next;
+        time_state = millis();
+    }
+
+    void fail(const char *reason) {
+        backoff = backoff == 0 ? BACKOFF_MIN : (backoff < BACKOFF_MAX / 2 ? backoff * 2 : BACKOFF_MAX);
+        printd("MQTT %s, retry in %u ms", reason, backoff);
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        // The rest of a partly sent packet would corrupt the next session
+        if (tx_sent != 0) {
+            pop(tx_sizes[tx_first] - tx_sent);
+        }
+        rx_length = 0;
+        rx_skip = 0;
+        failures++;
+        enter(IDLE);
+    }
+
+    // Forgets the oldest packet, of which `unsent` bytes are still queued
+    void pop(uint16_t unsent) {
+        tx_tail = (tx_tail + unsent) % MQTT_TX_SIZE;
+        tx_used -= unsent;
+        tx_first = (tx_first + 1) % MQTT_TX_PACKETS;
+        tx_count--;
+        tx_sent = 0;
+    }
+
+    static uint8_t encode_length(uint8_t *buf, uint32_t length) {
+        uint8_t n = 0;
+        do {
+            uint8_t digit = length % 128;
+            length /= 128;
+            buf[n++] = digit | (length > 0 ? 0x80 : 0);
+        } while (length > 0);
+        return n;
+    }
+
+    // Queues a packet of a fixed header and up to three body parts
+    bool queue(uint8_t type, const void *a, uint16_t a_len, const void *b = nullptr, uint16_t b_len = 0,
+               const void *c = nullptr, uint16_t c_len = 0) {
+        uint8_t header[5];
+        header[0] = type;
+        uint8_t header_len = 1 + encode_length(header + 1, a_len + b_len + c_len);
+        uint16_t size = header_len + a_len + b_len + c_len;
+        if (size > MQTT_TX_SIZE) {
+            dropped++;
+            return false;
+        }
+        while (tx_count == MQTT_TX_PACKETS || MQTT_TX_SIZE - tx_used < size) {
+            // A packet that is partly on the wire can not be taken back
+            if (tx_sent != 0) {
+                dropped++;
+                return false;
+            }
+            pop(tx_sizes[tx_first]);
+            dropped++;
+        }
+
+        const void *parts[] = {header, a, b, c};
+        const uint16_t lengths[] = {header_len, a_len, b_len, c_len};
+        uint16_t head = (tx_tail + tx_used) % MQTT_TX_SIZE;
+        for (uint8_t i = 0; i < 4; ++i) {
+            const uint8_t *p = (const uint8_t*)parts[i];
+            for (uint16_t j = 0; j < lengths[i]; ++j) {
+                tx[head] = p[j];
+                head = (head + 1) % MQTT_TX_SIZE;
+            }
+        }
+        tx_used += size;
+        tx_sizes[(tx_first + tx_count) % MQTT_TX_PACKETS] = size;
+        tx_count++;
+        return true;
+    }
+
+    // Sends what the socket takes without blocking
+    void send_queue() {
+        while (tx_used > 0) {
+            uint16_t chunk = MQTT_TX_SIZE - tx_tail;
+            if (chunk > tx_used) {
+                chunk = tx_used;
+            }
+            int n = ::send(fd, tx + tx_tail, chunk, MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fail("send failed");
+                }
+                return;
+            }
+            last_out = millis();
+            // Account the sent bytes to the queued packets
+            uint16_t sent = n;
+            while (sent > 0) {
+                uint16_t rest = tx_sizes[tx_first] - tx_sent;
+                if (sent < rest) {
+                    tx_sent += sent;
+                    tx_tail = (tx_tail + sent) % MQTT_TX_SIZE;
+                    tx_used -= sent;
+                    break;
+                }
+                sent -= rest;
+                pop(rest);
+            }
+            if (n < chunk) {
                 return;
             }
+        }
+    }
+
+    // CONNECT and SUBSCRIBE go ahead of the queue on a fresh connection, the
+    // socket buffer is empty then and takes them whole
+    bool send_direct(const uint8_t *buf, uint16_t length) {
+        int n = ::send(fd, buf, length, MSG_DONTWAIT);
+        if (n != length) {
+            return false;
+        }
+        last_out = millis();
+        return true;
+    }
+
+    bool send_connect() {
+        uint16_t id_len = strlen(client_id);
+        uint8_t buf[16 + 32];
+        if (id_len > 32) {
+            return false;
+        }
+        const uint8_t variable[] = {
+            0x00, 0x04, 'M', 'Q', 'T', 'T',
+            0x04,                   // Protocol level 3.1.1
+            0x02,                   // Clean session
+            0x00, MQTT_KEEPALIVE,
+            (uint8_t)(id_len >> 8), (uint8_t)id_len,
+        };
+        buf[0] = CONNECT;
+        uint8_t n = 1 + encode_length(buf + 1, sizeof(variable) + id_len);
+        memcpy(buf + n, variable, sizeof(variable));
+        memcpy(buf + n + sizeof(variable), client_id, id_len);
+        return send_direct(buf, n + sizeof(variable) + id_len);
+    }
+
+    bool send_subscribe(const char *topic) {
+        uint16_t topic_len = strlen(topic);
+        uint8_t buf[8 + 64];
+        if (topic_len > 64) {
+            return false;
+        }
+        buf[0] = SUBSCRIBE;
+        uint8_t n = 1 + encode_length(buf + 1, 2 + 2 + topic_len + 1);
+        buf[n++] = 0x00; // Packet identifier
+        buf[n++] = 0x01;
+        buf[n++] = topic_len >> 8;
+        buf[n++] = topic_len;
+        memcpy(buf + n, topic, topic_len);
+        n += topic_len;
+        buf[n++] = 0x00; // QoS 0
+        return send_direct(buf, n);
+    }
+
+    void open() {
+        fd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (fd < 0) {
+            fail("socket failed");
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(broker_port);
+        addr.sin_addr.s_addr = inet_addr(broker);
+        if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {
+            fail("connect failed");
+            return;
+        }
+        enter(CONNECTING);
+    }
+
+    // The connect completed once the socket turns writable
+    void check_connected() {
+        fd_set writable;
+        FD_ZERO(&writable);
+        FD_SET(fd, &writable);
+        struct timeval poll = {0, 0};
+        if (::select(fd + 1, nullptr, &writable, nullptr, &poll) <= 0) {
+            if (millis() - time_state >= TIMEOUT) {
+                fail("connect timeout");
+            }
+            return;
+        }
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            fail("connect refused");
+            return;
+        }
+        if (!send_connect()) {
+            fail("CONNECT failed");
+            return;
+        }
+        last_in = millis();
+        enter(HANDSHAKE);
+    }
+
+    void on_connack() {
+        if (!send_subscribe("cmnd/shutter/#")) {
+            fail("SUBSCRIBE failed");
+            return;
+        }
+        printd("MQTT connected");
+        connects++;
+        backoff = 0;
+        ping_outstanding = false;
+        enter(CONNECTED);
+        publish("stat/shutter/state", "alive");
+    }
+
+    void dispatch(uint8_t *packet, uint16_t header_len, uint16_t length) {
+        uint8_t *body = packet + header_len;
+        switch (packet[0] & 0xf0) {
+            case CONNACK:
+                if (state != HANDSHAKE || length < 2 || body[1] != 0) {
+                    fail("connection rejected");
+                    return;
+                }
+                on_connack();
+                break;
+            case PUBLISH: {
+                if (length < 2 || state != CONNECTED) {
+                    break;
+                }
+                uint16_t topic_len = (body[0] << 8) | body[1];
+                uint16_t offset = 2 + topic_len + ((packet[0] & 0x06) ? 2 : 0); // Packet id above QoS 0
+                if (offset > length) {
+                    break;
+                }
+                // Move the topic over its length field to terminate it in place
+                memmove(body + 1, body + 2, topic_len);
+                body[1 + topic_len] = '\0';
+                if (callback != nullptr) {
+                    callback((char*)body + 1, body + offset, length - offset);
+                }
+                break;
+            }
+            case PINGRESP:
+                ping_outstanding = false;
+                break;
+            default: // SUBACK
+                break;
+        }
+    }
 
-            if (client.connect(clientId.c_str())) {
-                printd("MQTT connected");
-                client.subscribe("cmnd/shutter/up");
-                client.subscribe("cmnd/shutter/down");
-                client.subscribe("cmnd/shutter/off");
-                snprintf(buffer, 50, "alive");
-                client.publish("stat/shutter/state", buffer);
-                last_connection_trial = 0;
+    // Reads what arrived and dispatches every complete packet
+    void receive() {
+        for (;;) {
+            int n;
+            if (rx_skip > 0) {
+                n = ::recv(fd, rx, rx_skip < sizeof(rx) ? rx_skip : sizeof(rx), MSG_DONTWAIT);
             } else {
-                printd("MQTT connection failed");
-                last_connection_trial = current_time;
+                n = ::recv(fd, rx + rx_length, sizeof(rx) - rx_length, MSG_DONTWAIT);
+            }
+            if (n == 0) {
+                fail("connection closed");
+                return;
+            }
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fail("receive failed");
+                }
+                return;
+            }
+            last_in = millis();
+            if (rx_skip > 0) {
+                rx_skip -= n;
+                continue;
+            }
+            rx_length += n;
+
+            // Complete packets at the front of the buffer
+            while (rx_length >= 2) {
+                uint32_t length = 0;
+                uint8_t header_len = 1;
+                bool complete = false;
+                for (uint8_t shift = 0; header_len < rx_length && header_len <= 4; shift += 7) {
+                    uint8_t digit = rx[header_len++];
+                    length |= (uint32_t)(digit & 0x7f) << shift;
+                    if ((digit & 0x80) == 0) {
+                        complete = true;
+                        break;
+                    }
+                }
+                if (!complete) {
+                    if (header_len > 4) {
+                        fail("malformed packet");
+                        return;
+                    }
+                    break;
+                }
+                uint32_t size = header_len + length;
+                if (size > sizeof(rx)) {
+                    printd("MQTT packet of %u bytes skipped", size);
+                    rx_skip = size - rx_length;
+                    rx_length = 0;
+                    break;
+                }
+                if (rx_length < size) {
+                    break;
+                }
+                dispatch(rx, header_len, length);
+                if (fd < 0) {
+                    return;
+                }
+                rx_length -= size;
+                memmove(rx, rx + size, rx_length);
             }
         }
     }
 
-public:
-    Mqtt() {
-        client.setServer(broker.c_str(), broker_port);
+    void keepalive() {
+        uint32_t time_current = millis();
+        uint32_t interval = MQTT_KEEPALIVE * 1000;
+        if (time_current - last_in < interval && time_current - last_out < interval) {
+            return;
+        }
+        if (ping_outstanding) {
+            fail("keepalive timeout");
+            return;
+        }
+        if (queue(PINGREQ, nullptr, 0)) {
+            ping_outstanding = true;
+            last_in = time_current;
+            last_out = time_current;
+        }
     }
 
+public:
     void handle() {
-        reconnect_if_needed();
-        client.loop();
+        switch (state) {
+            case IDLE:
+                if (millis() - time_state >= backoff) {
+                    open();
+                }
+                break;
+            case CONNECTING:
+                check_connected();
+                break;
+            case HANDSHAKE:
+                receive();
+                if (state == HANDSHAKE && millis() - time_state >= TIMEOUT) {
+                    fail("handshake timeout");
+                }
+                break;
+            case CONNECTED:
+                receive();
+                if (state == CONNECTED) {
+                    keepalive();
+                }
+                if (state == CONNECTED) {
+                    send_queue();
+                }
+                break;
+        }
+    }
+
+    void setServer(const char *broker, uint16_t port) {
+        this->broker = broker;
+        this->broker_port = port;
     }
 
-    void setCallback(MQTT_CALLBACK_SIGNATURE) {
-        client.setCallback(callback);
+    void setCallback(Callback callback) {
+        this->callback = callback;
     }
 
-    void publish(const char* topic, String payload) {
-        client.publish(topic, payload.c_str());
+    bool connected() {
+        return state == CONNECTED;
+    }
+
+    // Queues the message, also while disconnected, false if it was dropped
+    bool publish(const char *topic, const char *payload, bool retained = false) {
+        uint16_t topic_len = strlen(topic);
+        uint8_t length[] = {(uint8_t)(topic_len >> 8), (uint8_t)topic_len};
+        return queue(PUBLISH | (retained ? 0x01 : 0x00), length, sizeof(length), topic, topic_len, payload, strlen(payload));
+    }
+
+    uint16_t queued() {return tx_count;}
+
+    // Statistics as JSON, returns the snprintf() result
+    int format(char *buf, size_t len) {
+        return snprintf(buf, len, "{\"connected\":%u,\"connects\":%u,\"failures\":%u,\"queued\":%u,\"dropped\":%u}",
+                        state == CONNECTED, (unsigned)connects, (unsigned)failures, tx_count, (unsigned)dropped);
     }
 };
@@ -0,0 +1,263 @@
+#pragma once
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include "control.h"
+
+// Command topics, with the motor either in the topic or, for the legacy
+// topics, in the payload:
+//   cmnd/shutter/<motor>/<verb>
+//   cmnd/shutter/<verb>          payload: <motor>, ignored for "off"
+//   cmnd/shutter/<motor>/position payload: <percent>, 100 is fully up
+//   cmnd/shutter/bulk            payload: <target>:<verb>[:<ms>],...
+// A bulk target is a motor, a 0x<hex> motor mask or * for all motors. Its
+// up and down run the motors in that direction whatever their state, for the
+// given time or the full travel time, position takes a percentage instead of
+// the time, and all actions apply in one tick.
+#define MQTT_TOPIC_PREFIX "cmnd/shutter/"
+
+// FNV-1a of a topic level, up to the next '/' or the end
+constexpr uint32_t topic_hash(const char *s, uint32_t hash = 2166136261u) {
+    return (*s == '\0' || *s == '/') ? hash : topic_hash(s + 1, (hash ^ (uint8_t)*s) * 16777619u);
+}
+
+struct MqttVerb {
+    const char *name;
+    uint32_t hash;
+    MotorCommand::Type type;
+    Motor::MotorStates direction;
+};
+
+static constexpr MqttVerb mqtt_verbs[] = {
+    {"up",       topic_hash("up"),       MotorCommand::TOGGLE,   Motor::MotorStates::UP},
+    {"down",     topic_hash("down"),     MotorCommand::TOGGLE,   Motor::MotorStates::DOWN},
+    {"off",      topic_hash("off"),      MotorCommand::OFF,      Motor::MotorStates::OFF},
+    {"bulk",     topic_hash("bulk"),     MotorCommand::BULK,     Motor::MotorStates::OFF},
+    {"position", topic_hash("position"), MotorCommand::POSITION, Motor::MotorStates::OFF},
+};
+
+enum MqttParseResult {
+    PARSE_OK,
+    PARSE_UNKNOWN_TOPIC,
+    PARSE_BAD_PAYLOAD,
+    PARSE_BAD_MOTOR,
+};
+
+struct MqttCommand {
+    const MqttVerb *verb;
+    uint8_t motor; // Index or MOTOR_ALL
+    uint16_t position; // Per mille, only for the position verb
+    BulkCommand bulk;  // Only for the bulk verb
+};
+
+// Unsigned decimal, optionally surrounded by whitespace
+inline bool mqtt_parse_uint(const uint8_t *p, unsigned int length, uint32_t &value) {
+    unsigned int i = 0;
+    uint8_t digits = 0;
+    value = 0;
+    while (i < length && isspace(p[i])) {
+        i++;
+    }
+    while (i < length && p[i] >= '0' && p[i] <= '9') {
+        if (++digits > 9) {
+            return false;
+        }
+        value = value * 10 + (p[i++] - '0');
+    }
+    while (i < length && isspace(p[i])) {
+        i++;
+    }
+    return digits > 0 && i == length;
+}
+
+inline const MqttVerb *mqtt_find_verb(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    for (const MqttVerb &verb : mqtt_verbs) {
+        if (verb.hash == hash && strncmp(verb.name, name, length) == 0 && verb.name[length] == '\0') {
+            return &verb;
+        }
+    }
+    return nullptr;
+}
+
+inline const MqttVerb *mqtt_find_verb(const char *name) {
+    return mqtt_find_verb(name, strlen(name));
+}
+
+// Motor mask of a bulk target: <motor>, 0x<hex mask> or *
+inline bool mqtt_parse_target(const uint8_t *p, unsigned int length, uint8_t &mask) {
+    if (length == 1 && p[0] == '*') {
+        mask = (1 << NUM_MOTORS) - 1;
+        return true;
+    }
+    if (length > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        if (length > 2 + 8) {
+            return false;
+        }
+        uint32_t value = 0;
+        for (unsigned int i = 2; i < length; ++i) {
+            if (!isxdigit(p[i])) {
+                return false;
+            }
+            value = value * 16 + (isdigit(p[i]) ? p[i] - '0' : (tolower(p[i]) - 'a' + 10));
+        }
+        mask = value;
+        return value != 0 && value < (1u << NUM_MOTORS);
+    }
+    uint32_t motor;
+    if (!mqtt_parse_uint(p, length, motor) || motor >= NUM_MOTORS) {
+        return false;
+    }
+    mask = 1 << motor;
+    return true;
+}
+
+// One <target>:<verb>[:<ms>] entry of a bulk payload
+inline bool mqtt_parse_bulk_entry(const uint8_t *p, unsigned int length, BulkCommand &bulk) {
+    while (length > 0 && isspace(*p)) {
+        p++;
+        length--;
+    }
+    const uint8_t *end = p + length;
+    const uint8_t *sep = (const uint8_t*)memchr(p, ':', length);
+    if (sep == nullptr) {
+        return false;
+    }
+    uint8_t mask;
+    if (!mqtt_parse_target(p, sep - p, mask)) {
+        return false;
+    }
+
+    const uint8_t *name = sep + 1;
+    unsigned int remaining = end - name;
+    while (remaining > 0 && isspace(*name)) {
+        name++;
+        remaining--;
+    }
+    const uint8_t *name_end = (const uint8_t*)memchr(name, ':', remaining);
+    bool timed = name_end != nullptr;
+    if (!timed) {
+        name_end = end;
+        while (name_end > name && isspace(name_end[-1])) {
+            name_end--;
+        }
+    }
+    const MqttVerb *verb = mqtt_find_verb((const char*)name, name_end - name);
+    if (verb == nullptr || verb->type == MotorCommand::BULK) {
+        return false;
+    }
+    uint32_t duration = 0;
+    if (timed && !mqtt_parse_uint(name_end + 1, end - name_end - 1, duration)) {
+        return false;
+    }
+    if (verb->type == MotorCommand::POSITION && (!timed || duration > 100)) {
+        return false;
+    }
+    if (verb->type == MotorCommand::TOGGLE && timed && duration == 0) { // A run without a stop timer
+        return false;
+    }
+
+    for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+        if ((mask & (1 << m)) == 0) {
+            continue;
+        }
+        BulkCommand::Action &action = bulk.actions[m];
+        if (verb->type == MotorCommand::OFF) {
+            action.type = MotorCommand::OFF;
+            action.duration = 0;
+        } else if (verb->type == MotorCommand::POSITION) {
+            action.type = MotorCommand::POSITION;
+            action.duration = duration * (POSITION_MAX / 100);
+        } else {
+            // Never longer than a full travel, like every other MQTT move
+            uint32_t travel = control_travel_time(m);
+            action.type = MotorCommand::SET;
+            action.duration = timed && duration < travel ? duration : travel;
+        }
+        action.direction = verb->direction;
+    }
+    bulk.mask |= mask;
+    return true;
+}
+
+// Comma separated entries, a later entry for a motor overrides an earlier one
+inline bool mqtt_parse_bulk(const uint8_t *payload, unsigned int length, BulkCommand &bulk) {
+    bulk.mask = 0;
+    const uint8_t *p = payload;
+    const uint8_t *end = payload + length;
+    while (p < end) {
+        const uint8_t *next = (const uint8_t*)memchr(p, ',', end - p);
+        if (next == nullptr) {
+            next = end;
+        }
+        if (!mqtt_parse_bulk_entry(p, next - p, bulk)) {
+            return false;
+        }
+        p = next + 1;
+    }
+    return bulk.mask != 0;
+}
+
+// Parses a received message in place, without copying or allocating
+inline MqttParseResult mqtt_parse(const char *topic, const uint8_t *payload, unsigned int length, MqttCommand &command) {
+    if (strncmp(topic, MQTT_TOPIC_PREFIX, sizeof(MQTT_TOPIC_PREFIX) - 1) != 0) {
+        return PARSE_UNKNOWN_TOPIC;
+    }
+    const char *level = topic + sizeof(MQTT_TOPIC_PREFIX) - 1;
+
+    // Motor in the topic
+    bool indexed = false;
+    uint32_t motor = 0;
+    if (*level >= '0' && *level <= '9') {
+        const char *end = strchr(level, '/');
+        if (end == nullptr || !mqtt_parse_uint((const uint8_t*)level, end - level, motor)) {
+            return PARSE_UNKNOWN_TOPIC;
+        }
+        level = end + 1;
+        indexed = true;
+    }
+
+    command.verb = mqtt_find_verb(level);
+    if (command.verb == nullptr) {
+        return PARSE_UNKNOWN_TOPIC;
+    }
+
+    if (command.verb->type == MotorCommand::BULK) {
+        if (indexed) {
+            return PARSE_UNKNOWN_TOPIC;
+        }
+        command.motor = MOTOR_ALL;
+        return mqtt_parse_bulk(payload, length, command.bulk) ? PARSE_OK : PARSE_BAD_PAYLOAD;
+    }
+
+    if (command.verb->type == MotorCommand::POSITION) {
+        uint32_t percent;
+        if (!indexed) {
+            return PARSE_UNKNOWN_TOPIC;
+        }
+        if (!mqtt_parse_uint(payload, length, percent) || percent > 100) {
+            return PARSE_BAD_PAYLOAD;
+        }
+        command.position = percent * (POSITION_MAX / 100);
+    }
+
+    // Legacy topics, off stops every motor
+    if (!indexed) {
+        if (command.verb->type == MotorCommand::OFF) {
+            command.motor = MOTOR_ALL;
+            return PARSE_OK;
+        }
+        if (!mqtt_parse_uint(payload, length, motor)) {
+            return PARSE_BAD_PAYLOAD;
+        }
+    }
+
+    if (motor >= NUM_MOTORS) {
+        return PARSE_BAD_MOTOR;
+    }
+    command.motor = motor;
+    return PARSE_OK;
+}
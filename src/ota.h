@@ -3,30 +3,115 @@
 #include <ESPmDNS.h>
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
+#include <Update.h>
+#include "control.h"
 #include "debug.h"
 
+#define OTA_STOP_DEADLINE 100 // ms for the control task to confirm all motors stopped
+
+// Runs ArduinoOTA in a task of its own: a transfer blocks inside
+// ArduinoOTA.handle() until it completes, which would otherwise stall MQTT
+// and the console for the whole upload. Motors are stopped before the flash
+// is written and held stopped until the upload ends, as erasing the flash
+// stalls the control task. An upload is refused when the stop is not
+// confirmed in time. The reboot is left to the network task so the report
+// and the motor state can go out first.
 class Upgrade {
 private:
-    bool is_initialized = false;
+    enum State : uint8_t {
+        IDLE,
+        RUNNING,
+        DONE,   // Reboot pending
+    };
+
+    volatile State state = IDLE;
     unsigned int last_progress = 0;
+
+    // Transfer statistics of the last upload
+    uint32_t time_start = 0;
+    uint32_t time_progress = 0;
+    uint32_t bytes = 0;
+    uint32_t duration = 0;
+    uint32_t max_stall = 0; // ms without progress
+    uint32_t max_tick_gap = 0; // us between control ticks
+
+    // Stops every motor and waits for the control task to confirm, returns
+    // whether it did
+    static bool stop_motors() {
+        command_push(MotorCommand::OFF, MOTOR_ALL, Motor::MotorStates::OFF, 0, ORIGIN_SYSTEM);
+        uint32_t time_begin = millis();
+        while (millis() - time_begin < OTA_STOP_DEADLINE) {
+            ControlSnapshot snapshot = control_snapshot();
+            bool stopped = true;
+            for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+                stopped = stopped && snapshot.motor_state[m] == Motor::MotorStates::OFF &&
+                          snapshot.motor_pending[m] == Motor::MotorStates::OFF;
+            }
+            if (stopped) {
+                return true;
+            }
+            vTaskDelay(pdMS_TO_TICKS(TIME_TICK));
+        }
+        printd("Upgrade: motors not confirmed stopped within %u ms", OTA_STOP_DEADLINE);
+        return false;
+    }
+
+    static void task(void *arg) {
+        Upgrade *upgrade = static_cast<Upgrade*>(arg);
+        while (!WiFi.isConnected()) {
+            vTaskDelay(pdMS_TO_TICKS(100));
+        }
+        ArduinoOTA.begin();
+        printd("Upgrade system ready");
+        for (;;) {
+            if (upgrade->state != DONE) {
+                ArduinoOTA.handle();
+            }
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+
 public:
     void setup() {
         ArduinoOTA.setHostname("shutter");
+        ArduinoOTA.setRebootOnSuccess(false);
 
-        ArduinoOTA.onStart([]() {
+        ArduinoOTA.onStart([this]() {
             if (ArduinoOTA.getCommand() == U_FLASH) {
                 printd("Start updating sketch");
             } else { // U_SPIFFS
                 printd("Start updating SPIFFS");
             }
             // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
+            control_hold_motors(true);
+            if (!stop_motors()) {
+                Update.abort(); // Fails the transfer, onError() releases the motors
+                return;
+            }
+            this->state = RUNNING;
+            this->bytes = 0;
+            this->max_stall = 0;
+            this->time_start = millis();
+            this->time_progress = this->time_start;
+            control_take_max_gap();
         });
 
-        ArduinoOTA.onEnd([]() {
+        ArduinoOTA.onEnd([this]() {
+            this->duration = millis() - this->time_start;
+            this->max_tick_gap = control_take_max_gap();
+            stop_motors();
             printd("End");
+            this->state = DONE;
         });
 
         ArduinoOTA.onProgress([this](unsigned int progress, unsigned int total) {
+            uint32_t time_current = millis();
+            if (time_current - this->time_progress > this->max_stall) {
+                this->max_stall = time_current - this->time_progress;
+            }
+            this->time_progress = time_current;
+            this->bytes = progress;
+
             unsigned int progress_percent = progress / (total / 100);
             if (progress_percent % 10 != 0) {
                 return;
@@ -36,8 +121,10 @@ public:
                 this->last_progress = progress_percent;
             }
         });
-        
-        ArduinoOTA.onError([](ota_error_t error) {
+
+        ArduinoOTA.onError([this](ota_error_t error) {
+            this->state = IDLE;
+            control_hold_motors(false);
             if (error == OTA_AUTH_ERROR) printd("Upgrade error: Auth Failed");
             else if (error == OTA_BEGIN_ERROR) printd("Upgrade error: Begin Failed");
             else if (error == OTA_CONNECT_ERROR) printd("Upgrade error: Connect Failed");
@@ -46,18 +133,19 @@ public:
         });
     }
 
-    void handle()
-    {
-        if (!WiFi.isConnected()) {
-            return;
-        }
+    // Starts the OTA task, which waits for WiFi on its own
+    void begin(BaseType_t core) {
+        xTaskCreatePinnedToCore(task, "ota", 4096, this, 1, nullptr, core);
+    }
 
-        if (this->is_initialized) {
-            ArduinoOTA.handle();
-        } else {
-            ArduinoOTA.begin();
-            this->is_initialized = true;
-            printd("Upgrade system ready");
-        }
+    bool isRebootPending() {
+        return state == DONE;
+    }
+
+    // Statistics of the last upload as JSON, returns the snprintf() result
+    int format(char *buf, size_t len) {
+        uint32_t kbps = duration != 0 ? bytes / duration : 0; // bytes/ms = kB/s
+        return snprintf(buf, len, "{\"bytes\":%u,\"ms\":%u,\"kBps\":%u,\"max_stall_ms\":%u,\"max_tick_gap_us\":%u}",
+                        (unsigned)bytes, (unsigned)duration, (unsigned)kbps, (unsigned)max_stall, (unsigned)max_tick_gap);
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+
+// Shadow of the output register of a port, as written by the relays. A
+// change is one masked update of the whole word, the port sends it to the
+// hardware when it is flushed. Pin n is bit n.
+class OutputRegister {
+protected:
+    uint64_t _reg_output = 0;
+    bool _reachable = true;
+
+public:
+    void write(uint64_t clear, uint64_t set) {
+        _reg_output = (_reg_output & ~clear) | set;
+    }
+
+    uint64_t output() {return _reg_output;}
+
+    // Whether writes currently reach the hardware
+    bool isReachable() {return _reachable;}
+};
@@ -1,8 +1,11 @@
 #pragma once
 #include <Arduino.h>
 #include <Wire.h>
+#include <initializer_list>
+#include "debug.h"
+#include "output.h"
 
-class PCA9534 {
+class PCA9534 : public OutputRegister {
 private:
     enum registers {
         REG_INPUT_PORT = 0x00,
@@ -11,30 +14,153 @@ private:
         REG_CONFIGURATION = 0x03,
     };
 
+    enum dirty_flags {
+        DIRTY_OUTPUT = 0x01,
+        DIRTY_CONFIGURATION = 0x02,
+        DIRTY_ALL = DIRTY_OUTPUT | DIRTY_CONFIGURATION,
+    };
+
+    static const uint8_t POINTER_UNKNOWN = 0xff;
+    static const uint8_t RETRIES = 2;           // Per transfer while healthy
+    static const uint8_t FAILURES_UNHEALTHY = 3; // Consecutive failed transfers
+    static const uint32_t PROBE_INTERVAL = 1000; // Between attempts while unhealthy
+    static const uint32_t POLL_INTERVAL = 50;    // Safety poll while sampling on interrupt
+
     uint8_t _address; // I2C address of the device
     uint8_t _configuration = 0xff; // All pins are inputs initially
-    uint8_t _reg_output = 0x00;
     uint8_t _reg_input = 0x00;
 
-    void writeRegister(enum registers reg, uint8_t value) {
+    // Last values sent to the chip, writes are skipped when these match
+    uint8_t _sent_configuration = 0xff;
+    uint8_t _sent_output = 0x00;
+    uint8_t _dirty = 0;
+
+    // Periodic unconditional rewrite of the shadow registers, 0 = disabled
+    uint32_t _resync_interval = 0;
+    uint32_t _last_resync = 0;
+
+    // Input sampling: every handle() when polling, otherwise on interrupt
+    // with a slow safety poll as fallback
+    bool _polling = true;
+    uint32_t _last_poll = 0;
+    volatile bool _input_pending = true;
+
+    // The chip keeps its command byte between transactions, so reading the
+    // same register again needs no pointer write
+    uint8_t _pointer = POINTER_UNKNOWN;
+
+    // Bus traffic of this device
+    uint32_t _transactions = 0;
+    uint32_t _bytes = 0;
+
+    // Health: a device is unreachable after FAILURES_UNHEALTHY transfers in
+    // a row failed, and is then only probed once per PROBE_INTERVAL without
+    // retries, so a missing chip does not stall the loop on timeouts
+    uint8_t _failures = 0;
+    uint32_t _errors = 0;  // Failed attempts
+    uint32_t _retries = 0;
+    uint32_t _last_probe = 0;
+
+    bool writeOnce(enum registers reg, uint8_t value) {
         Wire.beginTransmission(_address);
         Wire.write(reg);
         Wire.write(value);
-        Wire.endTransmission();
+        bool ok = Wire.endTransmission() == 0;
+        _pointer = ok ? (uint8_t)reg : POINTER_UNKNOWN;
+        _transactions++;
+        _bytes += 2;
+        return ok;
     }
 
-    uint8_t readRegister(enum registers reg) {
-        uint8_t value = 0;
-        // Send register to read from
-        Wire.beginTransmission(_address);
-        Wire.write(reg);
-        Wire.endTransmission();
+    bool readOnce(enum registers reg, uint8_t &value) {
+        // Send register to read from, unless the chip still points at it
+        if (_pointer != reg) {
+            Wire.beginTransmission(_address);
+            Wire.write(reg);
+            bool ok = Wire.endTransmission() == 0;
+            _pointer = ok ? (uint8_t)reg : POINTER_UNKNOWN;
+            _transactions++;
+            _bytes += 1;
+            if (!ok) {
+                return false;
+            }
+        }
         // Read a single byte
-        Wire.requestFrom(_address, 1u);
-        if (1 <= Wire.available()) {
-            value = Wire.read();
+        _transactions++;
+        _bytes += 1;
+        if (Wire.requestFrom(_address, 1u) != 1 || Wire.available() < 1) {
+            _pointer = POINTER_UNKNOWN;
+            return false;
+        }
+        value = Wire.read();
+        return true;
+    }
+
+    // Bookkeeping after each transfer, returns ok
+    bool result(bool ok) {
+        if (ok) {
+            if (_failures >= FAILURES_UNHEALTHY) {
+                printd("Expander 0x%02x reachable again", _address);
+                // It may have been power cycled, restore every register
+                _dirty = DIRTY_ALL;
+            }
+            _failures = 0;
+        } else if (_failures < 0xff && ++_failures == FAILURES_UNHEALTHY) {
+            printd("Expander 0x%02x unreachable", _address);
+        }
+        _reachable = isHealthy();
+        return ok;
+    }
+
+    uint8_t attempts() {
+        return isHealthy() ? RETRIES + 1 : 1;
+    }
+
+    bool writeRegister(enum registers reg, uint8_t value) {
+        for (uint8_t i = attempts(); i > 0; --i) {
+            if (writeOnce(reg, value)) {
+                return result(true);
+            }
+            _errors++;
+            _retries += (i > 1);
+        }
+        return result(false);
+    }
+
+    // Leaves value untouched on failure
+    bool readRegister(enum registers reg, uint8_t &value) {
+        for (uint8_t i = attempts(); i > 0; --i) {
+            if (readOnce(reg, value)) {
+                return result(true);
+            }
+            _errors++;
+            _retries += (i > 1);
+        }
+        return result(false);
+    }
+
+    void writeDirty() {
+        // Relays update the output shadow through OutputRegister::write()
+        if ((uint8_t)_reg_output != _sent_output) {
+            _dirty |= DIRTY_OUTPUT;
+        }
+        // Output first, so pins switched to output come up at the right level
+        if ((_dirty & DIRTY_OUTPUT) && writeRegister(REG_OUTPUT_PORT, (uint8_t)_reg_output)) {
+            _sent_output = (uint8_t)_reg_output;
+            _dirty &= ~DIRTY_OUTPUT;
+        }
+        if ((_dirty & DIRTY_CONFIGURATION) && writeRegister(REG_CONFIGURATION, _configuration)) {
+            _sent_configuration = _configuration;
+            _dirty &= ~DIRTY_CONFIGURATION;
+        }
+    }
+
+    void updateDirty(uint8_t flag, uint8_t shadow, uint8_t sent) {
+        if (shadow != sent) {
+            _dirty |= flag;
+        } else {
+            _dirty &= ~flag;
         }
-        return value;
     }
 
 public:
@@ -43,34 +169,132 @@ public:
     }
 
     void begin() {
-        writeRegister(REG_CONFIGURATION, _configuration);
-        writeRegister(REG_OUTPUT_PORT, _reg_output);
-        _reg_input = readRegister(REG_INPUT_PORT);
+        _dirty = DIRTY_ALL;
+        writeDirty();
+        readRegister(REG_INPUT_PORT, _reg_input);
+        _last_resync = millis();
+        _last_poll = _last_resync;
+        _last_probe = _last_resync;
     }
 
     void handle() {
-        _reg_input = readRegister(REG_INPUT_PORT);
-        writeRegister(REG_OUTPUT_PORT, _reg_output);
-        writeRegister(REG_CONFIGURATION, _configuration);
+        uint32_t time_current = millis();
+        if (!isHealthy()) {
+            if (time_current - _last_probe < PROBE_INTERVAL) {
+                return;
+            }
+            _last_probe = time_current;
+        }
+
+        if (_polling || _input_pending || time_current - _last_poll >= POLL_INTERVAL) {
+            // Clear before reading, so a change during the read is not lost.
+            // A failed read keeps the last known inputs.
+            _input_pending = false;
+            readRegister(REG_INPUT_PORT, _reg_input);
+            _last_poll = time_current;
+        }
+
+        if (_resync_interval != 0) {
+            if (time_current - _last_resync >= _resync_interval) {
+                _dirty = DIRTY_ALL;
+                _last_resync = time_current;
+            }
+        }
+
+        writeDirty();
+    }
+
+    // Write the registers that changed since the last flush, what fails
+    // stays dirty for the next one. Unreachable devices are only written
+    // when handle() probes them.
+    void flush() {
+        if (isHealthy()) {
+            writeDirty();
+        }
+    }
+
+    // After a bus recovery, the chip may have seen a partial transfer
+    void invalidate() {
+        _pointer = POINTER_UNKNOWN;
+        _dirty = DIRTY_ALL;
     }
 
     void configure(uint8_t config) {
         _configuration = config;
-        writeRegister(REG_CONFIGURATION, _configuration);
+        updateDirty(DIRTY_CONFIGURATION, _configuration, _sent_configuration);
     }
 
     void pinMode(uint8_t pin, uint8_t mode) {
         uint8_t value = (mode == OUTPUT) ? 0 : 1;
         bitWrite(_configuration, pin, value);
-        writeRegister(REG_CONFIGURATION, _configuration);
+        updateDirty(DIRTY_CONFIGURATION, _configuration, _sent_configuration);
     }
 
     void digitalWrite(uint8_t pin, uint8_t value) {
-        bitWrite(_reg_output, pin, value);
-        writeRegister(REG_OUTPUT_PORT, _reg_output);
+        write(1ULL << pin, value ? 1ULL << pin : 0);
+        updateDirty(DIRTY_OUTPUT, (uint8_t)_reg_output, _sent_output);
     }
 
     uint8_t digitalRead(uint8_t pin) {
         return bitRead(_reg_input, pin);
     }
-};
\ No newline at end of file
+
+    // All pins as of the last read
+    uint8_t read() {
+        return _reg_input;
+    }
+
+    // Called from interrupt context when the INT line signals an input change
+    void IRAM_ATTR notify() {_input_pending = true;}
+
+    uint8_t getAddress() {return _address;}
+    uint32_t getTransactions() {return _transactions;}
+    uint32_t getBytes() {return _bytes;}
+    uint32_t getErrors() {return _errors;}
+    uint32_t getRetries() {return _retries;}
+    bool isHealthy() {return _failures < FAILURES_UNHEALTHY;}
+    void setResyncInterval(uint32_t ms) {_resync_interval = ms;}
+    void setPolling(bool enabled) {_polling = enabled;}
+};
+
+// Open-drain INT outputs of one or more expanders wired-OR onto a GPIO
+class PCA9534Interrupt {
+private:
+    static const uint8_t MAX_PORTS = 4;
+
+    uint8_t _pin = 0xff;
+    PCA9534 *_ports[MAX_PORTS];
+    uint8_t _num_ports = 0;
+
+    static void IRAM_ATTR isr(void *arg) {
+        static_cast<PCA9534Interrupt*>(arg)->notify();
+    }
+
+    void IRAM_ATTR notify() {
+        for (uint8_t i = 0; i < _num_ports; ++i) {
+            _ports[i]->notify();
+        }
+    }
+
+public:
+    void begin(uint8_t pin, std::initializer_list<PCA9534*> ports) {
+        _pin = pin;
+        _num_ports = 0;
+        for (PCA9534 *port : ports) {
+            if (_num_ports < MAX_PORTS) {
+                port->setPolling(false);
+                _ports[_num_ports++] = port;
+            }
+        }
+        ::pinMode(_pin, INPUT_PULLUP);
+        attachInterruptArg(_pin, isr, this, FALLING);
+    }
+
+    // Call before the expanders' handle(). A line that is still asserted
+    // means a change raced the previous read and produced no new edge.
+    void handle() {
+        if (_pin != 0xff && ::digitalRead(_pin) == LOW) {
+            notify();
+        }
+    }
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include <Arduino.h>
+#include "format.h"
+
+// Stage timing is only compiled in with -DPROFILER
+#ifdef PROFILER
+#define PROFILE_BEGIN(profiler)       (profiler).begin()
+#define PROFILE_MARK(profiler, stage) (profiler).mark(stage)
+#define PROFILE_END(profiler, stage)  (profiler).end(stage)
+#else
+#define PROFILE_BEGIN(profiler)       ((void)0)
+#define PROFILE_MARK(profiler, stage) ((void)0)
+#define PROFILE_END(profiler, stage)  ((void)0)
+#endif
+
+// Latency histograms of the stages of a loop, measured with the cycle
+// counter. A pass is timed with begin(), then mark() after each stage
+// attributes the time since the previous mark to that stage. Each profiler
+// must only be updated from a single task.
+template <uint8_t NumStages>
+class Profiler {
+public:
+    // Bucket 0 holds everything below 2^BUCKET_SHIFT cycles, bucket i the
+    // range [2^(BUCKET_SHIFT+i-1), 2^(BUCKET_SHIFT+i)), the last is open ended
+    static const uint8_t NUM_BUCKETS = 16;
+    static const uint8_t BUCKET_SHIFT = 8;
+
+private:
+    struct Stage {
+        uint32_t count;
+        uint32_t max;
+        uint32_t buckets[NUM_BUCKETS];
+    };
+
+    const char *const *names;
+    Stage stages[NumStages] = {};
+    uint32_t time_begin = 0;
+    uint32_t time_last = 0;
+
+    void record(uint8_t stage, uint32_t cycles) {
+        Stage &s = stages[stage];
+        uint32_t scaled = cycles >> BUCKET_SHIFT;
+        uint8_t bucket = 0;
+        if (scaled != 0) {
+            bucket = 32 - __builtin_clz(scaled);
+            if (bucket >= NUM_BUCKETS) {
+                bucket = NUM_BUCKETS - 1;
+            }
+        }
+        s.buckets[bucket]++;
+        s.count++;
+        if (cycles > s.max) {
+            s.max = cycles;
+        }
+    }
+
+public:
+    Profiler(const char *const *names) : names(names) {}
+
+    void begin() {
+        time_begin = ESP.getCycleCount();
+        time_last = time_begin;
+    }
+
+    void mark(uint8_t stage) {
+        uint32_t now = ESP.getCycleCount();
+        record(stage, now - time_last);
+        time_last = now;
+    }
+
+    // Records the whole pass since begin()
+    void end(uint8_t stage) {
+        uint32_t now = ESP.getCycleCount();
+        record(stage, now - time_begin);
+        time_last = now;
+    }
+
+    // Renders a stage as JSON
+    int format(uint8_t stage, char *buf, size_t len) {
+        const Stage &s = stages[stage];
+        int n = snprintf(buf, len, "{\"stage\":\"%s\",\"n\":%u,\"max_us\":%u,\"hist\":[",
+                         names[stage], (unsigned)s.count, (unsigned)(s.max / ESP.getCpuFreqMHz()));
+        for (uint8_t i = 0; i < NUM_BUCKETS; ++i) {
+            n = format_append(buf, len, n, i == 0 ? "%u" : ",%u", (unsigned)s.buckets[i]);
+        }
+        return format_append(buf, len, n, "]}");
+    }
+
+    static constexpr uint8_t size() {return NumStages;}
+};
@@ -0,0 +1,76 @@
+#pragma once
+#include <Arduino.h>
+#include "control.h"
+#include "mqtt.h"
+
+// Publishes motor state changes from any origin, at most once per interval:
+// retained stat/shutter/<motor>/state and /position topics for each motor
+// that changed and one retained stat/shutter/all snapshot of every motor. A group move thus
+// costs the same handful of messages however many motors it touches.
+class StatePublisher {
+private:
+    static const uint32_t INTERVAL = 200; // ms between two publishes at least
+    uint32_t last_publish = 0;
+    uint8_t dirty = 0;
+    bool was_connected = false;
+
+    // A start held back by the dead time or the supply budget is reported as
+    // pending, it was accepted and will run
+    static const char *state_name(Motor::MotorStates state, Motor::MotorStates pending) {
+        if (state == Motor::MotorStates::OFF && pending != Motor::MotorStates::OFF) {
+            return pending == Motor::MotorStates::UP ? "pending_up" : "pending_down";
+        }
+        switch (state) {
+            case Motor::MotorStates::UP:
+                return "up";
+            case Motor::MotorStates::DOWN:
+                return "down";
+            default:
+                return "off";
+        }
+    }
+
+public:
+    void handle(Mqtt &mqtt) {
+        dirty |= control_take_changes();
+
+        // Retained topics are republished in full after every reconnect
+        bool connected = mqtt.connected();
+        if (connected && !was_connected) {
+            dirty = (1 << NUM_MOTORS) - 1;
+        }
+        was_connected = connected;
+
+        uint32_t time_current = millis();
+        if (!connected || dirty == 0 || time_current - last_publish < INTERVAL) {
+            return;
+        }
+        last_publish = time_current;
+
+        ControlSnapshot state = control_snapshot();
+        char topic[32];
+        char position[8];
+        for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+            if (dirty & (1 << m)) {
+                snprintf(topic, sizeof(topic), "stat/shutter/%u/state", m);
+                mqtt.publish(topic, state_name(state.motor_state[m], state.motor_pending[m]), true);
+                // The final position once the motor stops
+                if (state.position[m] != POSITION_UNKNOWN && state.motor_state[m] == Motor::MotorStates::OFF &&
+                    state.motor_pending[m] == Motor::MotorStates::OFF) {
+                    snprintf(topic, sizeof(topic), "stat/shutter/%u/position", m);
+                    snprintf(position, sizeof(position), "%u", (state.position[m] + POSITION_MAX / 200) / (POSITION_MAX / 100));
+                    mqtt.publish(topic, position, true);
+                }
+            }
+        }
+
+        char payload[16 * NUM_MOTORS];
+        int n = snprintf(payload, sizeof(payload), "[");
+        for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+            n += snprintf(payload + n, sizeof(payload) - n, m == 0 ? "\"%s\"" : ",\"%s\"", state_name(state.motor_state[m], state.motor_pending[m]));
+        }
+        snprintf(payload + n, sizeof(payload) - n, "]");
+        mqtt.publish("stat/shutter/all", payload, true);
+        dirty = 0;
+    }
+};
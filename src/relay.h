@@ -1,34 +1,79 @@
 #pragma once
+#include "gpio.h"
 #include "pca9534.h"
 
-class Relay {
+// The two relays of a motor direction pair, which must never be on together.
+// Both sit on one port and are only driven through select(), a single masked
+// update of its output word that sets at most one of them, so there is no
+// way to command both on.
+class RelayInterlock {
+public:
+    enum Select : uint8_t {
+        NONE,
+        FIRST,
+        SECOND,
+    };
+
 private:
-    PCA9534 *port = nullptr;
-    uint8_t pin = 0xff;
+    OutputRegister *port = nullptr;
+    uint64_t first = 0;  // Pin masks
+    uint64_t second = 0;
+
 public:
-    Relay(){}
+    RelayInterlock(){}
 
-    Relay(PCA9534 *port, uint8_t pin) {
-        this->port = port;
-        this->pin = pin;
+    RelayInterlock(OutputRegister *port, uint64_t first, uint64_t second) : port(port), first(first), second(second) {}
+
+    void select(Select which) {
+        port->write(first | second, which == FIRST ? first : (which == SECOND ? second : 0));
     }
 
-    void set(uint8_t value) {
-        if (port != nullptr) {
-            port->digitalWrite(pin, value);
-        } else { // Internal port
-            digitalWrite(pin, value);
-        }
+    // As last selected
+    Select get() {
+        uint64_t output = port->output();
+        return (output & first) ? FIRST : ((output & second) ? SECOND : NONE);
     }
 
-    uint8_t get() {
-        if (port != nullptr) {
-            return port->digitalRead(pin);
-        } else { // Internal port
-            return digitalRead(pin);
+    bool isReachable() {return port->isReachable();}
+};
+
+// Groups relay changes across the expanders and the internal GPIOs, so they
+// reach the hardware together at commit(): one output register write per
+// expander followed by the GPIO set/clear registers. Transactions nest, only
+// the outermost commit() writes.
+class RelayTransaction {
+private:
+    static const uint8_t MAX_PORTS = 4;
+
+    PCA9534 *ports[MAX_PORTS];
+    uint8_t num_ports = 0;
+    GpioPort *internal = nullptr;
+    uint8_t depth = 0;
+
+public:
+    void setup(GpioPort *internal) {
+        this->internal = internal;
+        num_ports = 0;
+    }
+
+    // Adds an expander that drives relays
+    void add(PCA9534 *port) {
+        if (num_ports < MAX_PORTS) {
+            ports[num_ports++] = port;
         }
     }
 
-    void on() {set(HIGH);}
-    void off() {set(LOW);}
+    void begin() {
+        depth++;
+    }
+
+    void commit() {
+        if (depth == 0 || --depth != 0) {
+            return;
+        }
+        for (uint8_t i = 0; i < num_ports; ++i) {
+            ports[i]->flush();
+        }
+        internal->flush();
+    }
 };
\ No newline at end of file
@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded lock-free queue for many producers and a single consumer. Every
+// slot carries a sequence number telling producers and the consumer whose
+// turn it is, so neither side ever waits on the other. Size must be a power
+// of two.
+template <typename T, size_t Size>
+class MpscRing {
+private:
+    static_assert(Size >= 2 && (Size & (Size - 1)) == 0, "Ring size must be a power of two");
+
+    struct Cell {
+        std::atomic<uint32_t> sequence;
+        T data;
+    };
+
+    Cell cells[Size];
+    std::atomic<uint32_t> head{0}; // Next slot to claim for writing
+    uint32_t tail = 0;             // Next slot to read, consumer only
+    std::atomic<uint32_t> tail_published{0}; // Copy of tail for statistics
+
+    std::atomic<uint32_t> _pushed{0};
+    std::atomic<uint32_t> _dropped{0};
+    std::atomic<uint32_t> _high_water{0};
+
+    uint32_t tail_snapshot() {return tail_published.load(std::memory_order_relaxed);}
+
+public:
+    MpscRing() {
+        for (uint32_t i = 0; i < Size; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Safe from any task, returns false and counts a drop when full. With a
+    // `reserve` the push also fails when fewer slots are free, which keeps
+    // them for more important producers.
+    bool push(const T &value, uint32_t reserve = 0) {
+        uint32_t pos = head.load(std::memory_order_relaxed);
+        for (;;) {
+            if (reserve != 0 && pos - tail_snapshot() + reserve >= Size) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            Cell &cell = cells[pos & (Size - 1)];
+            uint32_t sequence = cell.sequence.load(std::memory_order_acquire);
+            int32_t diff = (int32_t)(sequence - pos);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    break;
+                }
+            } else if (diff < 0) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+
+        _pushed.fetch_add(1, std::memory_order_relaxed);
+        uint32_t depth = pos + 1 - tail_snapshot();
+        uint32_t high_water = _high_water.load(std::memory_order_relaxed);
+        while (depth > high_water && !_high_water.compare_exchange_weak(high_water, depth, std::memory_order_relaxed)) {}
+        return true;
+    }
+
+    // Consumer only
+    bool pop(T &value) {
+        Cell &cell = cells[tail & (Size - 1)];
+        uint32_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if (sequence != tail + 1) {
+            return false;
+        }
+        value = cell.data;
+        cell.sequence.store(tail + Size, std::memory_order_release);
+        tail_published.store(++tail, std::memory_order_relaxed);
+        return true;
+    }
+
+    uint32_t depth() {return head.load(std::memory_order_relaxed) - tail_snapshot();}
+    uint32_t pushed() {return _pushed.load(std::memory_order_relaxed);}
+    uint32_t dropped() {return _dropped.load(std::memory_order_relaxed);}
+    uint32_t high_water() {return _high_water.load(std::memory_order_relaxed);}
+    static constexpr size_t capacity() {return Size;}
+};
@@ -0,0 +1,131 @@
+#pragma once
+#include <Arduino.h>
+
+// Spaces out motor starts on a shared supply, which trips on the inrush
+// current of many motors starting in the same instant. Each supply group
+// allows at most `max_starts` starts within `inrush` ms and at least `gap` ms
+// between two starts. A start that does not fit is queued and granted from
+// handle() as soon as the budget allows, first come first served within the
+// group. Single task only.
+template <uint8_t Groups, uint8_t Size>
+class StartBudget {
+public:
+    typedef void (*Callback)(void *arg);
+
+private:
+    static const uint8_t MAX_STARTS = 4;
+
+    struct Group {
+        uint8_t max_starts = 1;
+        uint32_t gap = 0;
+        uint32_t inrush = 0;
+        uint32_t starts[MAX_STARTS] = {}; // Most recent first
+        uint8_t num_starts = 0;
+    };
+
+    struct Waiting {
+        uint8_t group;
+        Callback callback;
+        void *arg;
+    };
+
+    Group groups[Groups];
+    Waiting waiting[Size]; // In request order
+    uint8_t num_waiting = 0;
+
+    // Time until the group can take another start, 0 if it can now
+    uint32_t wait_time(const Group &group, uint32_t now) {
+        uint32_t wait = 0;
+        if (group.num_starts > 0 && now - group.starts[0] < group.gap) {
+            wait = group.gap - (now - group.starts[0]);
+        }
+        if (group.num_starts >= group.max_starts) {
+            uint32_t oldest = now - group.starts[group.max_starts - 1];
+            if (oldest < group.inrush && group.inrush - oldest > wait) {
+                wait = group.inrush - oldest;
+            }
+        }
+        return wait;
+    }
+
+    void take(Group &group, uint32_t now) {
+        if (group.num_starts < MAX_STARTS) {
+            group.num_starts++;
+        }
+        memmove(&group.starts[1], &group.starts[0], (group.num_starts - 1) * sizeof(group.starts[0]));
+        group.starts[0] = now;
+    }
+
+    bool queued(uint8_t group) {
+        for (uint8_t i = 0; i < num_waiting; ++i) {
+            if (waiting[i].group == group) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    void configure(uint8_t group, uint8_t max_starts, uint32_t gap, uint32_t inrush) {
+        groups[group].max_starts = max_starts < 1 ? 1 : (max_starts > MAX_STARTS ? MAX_STARTS : max_starts);
+        groups[group].gap = gap;
+        groups[group].inrush = inrush;
+    }
+
+    // Returns true when the caller may start right away. Otherwise the start
+    // is queued and `callback` runs from handle() once it is granted.
+    bool request(uint8_t group, uint32_t now, Callback callback, void *arg) {
+        if (!queued(group) && wait_time(groups[group], now) == 0) {
+            take(groups[group], now);
+            return true;
+        }
+        if (num_waiting >= Size) { // Cannot happen with one entry per motor
+            return false;
+        }
+        waiting[num_waiting++] = {group, callback, arg};
+        return false;
+    }
+
+    // Drops a queued start, e.g. when the motor is stopped before it began
+    void cancel(void *arg) {
+        for (uint8_t i = 0; i < num_waiting; ++i) {
+            if (waiting[i].arg == arg) {
+                memmove(&waiting[i], &waiting[i + 1], (num_waiting - i - 1) * sizeof(waiting[0]));
+                num_waiting--;
+                return;
+            }
+        }
+    }
+
+    // Grants the queued starts that fit the budget
+    void handle(uint32_t now) {
+        uint8_t i = 0;
+        while (i < num_waiting) {
+            Waiting entry = waiting[i];
+            if (wait_time(groups[entry.group], now) != 0) {
+                i++;
+                continue;
+            }
+            take(groups[entry.group], now);
+            memmove(&waiting[i], &waiting[i + 1], (num_waiting - i - 1) * sizeof(waiting[0]));
+            num_waiting--;
+            // wait_time() only depends on the group, so an entry never overtakes
+            // an earlier one of its own group
+            entry.callback(entry.arg);
+        }
+    }
+
+    // Time until the next queued start, UINT32_MAX when none is waiting
+    uint32_t next(uint32_t now) {
+        uint32_t next = UINT32_MAX;
+        for (uint8_t i = 0; i < num_waiting; ++i) {
+            uint32_t wait = wait_time(groups[waiting[i].group], now);
+            next = wait < next ? wait : next;
+        }
+        return next;
+    }
+};
+
+#define NUM_SUPPLIES       1
+#define NUM_STARTS_WAITING 8 // At least one per motor
+typedef StartBudget<NUM_SUPPLIES, NUM_STARTS_WAITING> Starter;
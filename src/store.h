@@ -0,0 +1,118 @@
+#pragma once
+#include <Arduino.h>
+#include <Preferences.h>
+#include <string.h>
+#include "control.h"
+#include "debug.h"
+
+#define STORE_VERSION 2
+
+// Motor positions and wear counters kept in NVS across reboots. Writes are
+// coalesced: the record is only committed once every motor has been stopped
+// for a quiet period, only when it differs from the stored one and at most
+// once per interval, so a group move or a burst of commands costs a single
+// write. NVS appends each write to its log of pages, which spreads the wear
+// over the whole partition. The start of a run is written right away, so a
+// motor that lost power while moving comes back with an unknown position
+// instead of a stale one.
+class StateStore {
+private:
+    struct Record {
+        uint16_t version;
+        uint16_t position[NUM_MOTORS];
+        uint32_t runs[NUM_MOTORS];
+        uint32_t run_time[NUM_MOTORS];
+        uint8_t moving; // Motors that were running, their position is lost
+    };
+
+    Preferences preferences;
+    Record stored = {};
+    static const uint32_t QUIET = 2000;     // ms with all motors stopped before a write
+    static const uint32_t INTERVAL = 10000; // ms between two writes at least
+    uint32_t last_motion = 0;
+    uint32_t last_commit = 0;
+    bool opened = false;
+
+public:
+    // Restores the motors, call between control_setup() and the start of the
+    // control task. A single blob read, so it takes well below a millisecond.
+    void begin() {
+        opened = preferences.begin("shutter", false);
+        if (!opened) {
+            printd("NVS unavailable, state is not persisted");
+            return;
+        }
+        Record record;
+        if (preferences.getBytes("state", &record, sizeof(record)) != sizeof(record) || record.version != STORE_VERSION) {
+            printd("No stored state");
+            return;
+        }
+        for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+            uint16_t position = (record.moving & (1 << m)) ? POSITION_UNKNOWN : record.position[m];
+            control_restore(m, position, record.runs[m], record.run_time[m]);
+        }
+        stored = record;
+        printd("Stored state restored");
+    }
+
+    // From the network task, never from the control task. A write blocks its
+    // caller for the whole erase and program, which the tick must not wait
+    // for. The cache stall of the write still delays the tick on both cores,
+    // see control_take_max_gap(), which is why writes are coalesced.
+    void handle() {
+        if (!opened) {
+            return;
+        }
+        uint32_t time_current = millis();
+        ControlSnapshot state = control_snapshot();
+        uint8_t moving = 0;
+        for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+            if (state.motor_state[m] != Motor::MotorStates::OFF || state.motor_pending[m] != Motor::MotorStates::OFF) {
+                moving |= 1 << m;
+            }
+        }
+        if (moving != 0) {
+            last_motion = time_current;
+            // Once per run, the record written after the stop clears it
+            if ((moving & ~stored.moving) != 0) {
+                commit(state, stored.moving | moving);
+            }
+            return;
+        }
+        if (time_current - last_motion < QUIET || time_current - last_commit < INTERVAL) {
+            return;
+        }
+        if (commit(state, 0)) {
+            last_commit = time_current;
+        }
+    }
+
+    // Writes the current state right away if it changed, before a reboot
+    void commit() {
+        if (opened) {
+            commit(control_snapshot(), 0);
+        }
+    }
+
+private:
+    // Returns whether a write was needed
+    bool commit(const ControlSnapshot &state, uint8_t moving) {
+        Record record;
+        memset(&record, 0, sizeof(record)); // Padding included, for memcmp()
+        record.version = STORE_VERSION;
+        memcpy(record.position, state.position, sizeof(record.position));
+        memcpy(record.runs, state.runs, sizeof(record.runs));
+        memcpy(record.run_time, state.run_time, sizeof(record.run_time));
+        record.moving = moving;
+        if (memcmp(&record, &stored, sizeof(record)) == 0) {
+            return false;
+        }
+
+        if (preferences.putBytes("state", &record, sizeof(record)) != sizeof(record)) {
+            printd("Storing state failed");
+            return true;
+        }
+        stored = record;
+        return true;
+    }
+};
@@ -0,0 +1,145 @@
+#pragma once
+#include <Arduino.h>
+
+// One-shot timers ordered by deadline in a binary min-heap. Timers are
+// allocated once with create() and then started and cancelled through their
+// handle; expire() only touches the timers that are due, so its cost does not
+// depend on how many timers exist. Single task only.
+template <uint8_t Size>
+class TimerHeap {
+public:
+    typedef void (*Callback)(void *arg);
+    typedef uint8_t Handle;
+    static const Handle INVALID = 0xff;
+
+private:
+    static const uint8_t NOT_QUEUED = 0xff;
+    static_assert(Size < NOT_QUEUED, "Too many timers");
+
+    struct Timer {
+        uint32_t deadline;
+        Callback callback;
+        void *arg;
+        uint8_t position; // Index in heap or NOT_QUEUED
+    };
+
+    Timer timers[Size];
+    Handle heap[Size];
+    uint8_t num_timers = 0;
+    uint8_t num_queued = 0;
+
+    bool before(uint8_t a, uint8_t b) {
+        return (int32_t)(timers[heap[a]].deadline - timers[heap[b]].deadline) < 0;
+    }
+
+    void swap(uint8_t a, uint8_t b) {
+        Handle tmp = heap[a];
+        heap[a] = heap[b];
+        heap[b] = tmp;
+        timers[heap[a]].position = a;
+        timers[heap[b]].position = b;
+    }
+
+    void sift_up(uint8_t i) {
+        while (i > 0) {
+            uint8_t parent = (i - 1) / 2;
+            if (!before(i, parent)) {
+                break;
+            }
+            swap(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(uint8_t i) {
+        for (;;) {
+            uint8_t smallest = i;
+            uint8_t left = 2 * i + 1;
+            uint8_t right = left + 1;
+            if (left < num_queued && before(left, smallest)) {
+                smallest = left;
+            }
+            if (right < num_queued && before(right, smallest)) {
+                smallest = right;
+            }
+            if (smallest == i) {
+                break;
+            }
+            swap(i, smallest);
+            i = smallest;
+        }
+    }
+
+    void remove(uint8_t position) {
+        timers[heap[position]].position = NOT_QUEUED;
+        num_queued--;
+        if (position == num_queued) {
+            return;
+        }
+        heap[position] = heap[num_queued];
+        timers[heap[position]].position = position;
+        sift_down(position);
+        sift_up(position);
+    }
+
+public:
+    // Returns INVALID once all timers are taken, the other calls ignore it
+    Handle create(Callback callback, void *arg) {
+        if (num_timers >= Size) {
+            return INVALID;
+        }
+        Timer &timer = timers[num_timers];
+        timer.callback = callback;
+        timer.arg = arg;
+        timer.position = NOT_QUEUED;
+        return num_timers++;
+    }
+
+    // (Re)starts the timer to fire `ms` after `now`
+    void start(Handle handle, uint32_t now, uint32_t ms) {
+        if (handle >= num_timers) {
+            return;
+        }
+        Timer &timer = timers[handle];
+        timer.deadline = now + ms;
+        if (timer.position == NOT_QUEUED) {
+            timer.position = num_queued;
+            heap[num_queued++] = handle;
+        }
+        sift_down(timer.position);
+        sift_up(timer.position);
+    }
+
+    void cancel(Handle handle) {
+        if (handle < num_timers && timers[handle].position != NOT_QUEUED) {
+            remove(timers[handle].position);
+        }
+    }
+
+    bool active(Handle handle) {
+        return handle < num_timers && timers[handle].position != NOT_QUEUED;
+    }
+
+    // Runs the callbacks of all expired timers, which may restart timers
+    void expire(uint32_t now) {
+        while (num_queued > 0 && (int32_t)(now - timers[heap[0]].deadline) >= 0) {
+            Timer &timer = timers[heap[0]];
+            remove(0);
+            timer.callback(timer.arg);
+        }
+    }
+
+    // Time until the next deadline, UINT32_MAX when no timer is running
+    uint32_t next(uint32_t now) {
+        if (num_queued == 0) {
+            return UINT32_MAX;
+        }
+        int32_t remaining = (int32_t)(timers[heap[0]].deadline - now);
+        return remaining > 0 ? remaining : 0;
+    }
+
+    uint8_t queued() {return num_queued;}
+};
+
+#define NUM_TIMERS 32 // At least one per button and motor
+typedef TimerHeap<NUM_TIMERS> Timers;
@@ -0,0 +1,49 @@
+#pragma once
+#include <Arduino.h>
+#include <algorithm>
+#include "format.h"
+
+// Hops of a command after it was received, an MQTT message or a debounced
+// button edge, in the order it passes them
+enum TraceHop : uint8_t {
+    HOP_PARSED,    // Command built and queued for the control task
+    HOP_SCHEDULED, // Applied to the motors by the control task
+    HOP_WRITTEN,   // Relay outputs written to the expanders
+    HOP_PUBLISHED, // Response queued for the broker, MQTT commands only
+    NUM_TRACE_HOPS,
+};
+
+// Latencies of the last Size samples, for rolling percentiles. Single task
+// only.
+template <uint8_t Size>
+class LatencyWindow {
+private:
+    uint32_t samples[Size];
+    uint8_t next = 0;
+    uint8_t filled = 0;
+    uint32_t count = 0;
+
+public:
+    void add(uint32_t us) {
+        samples[next] = us;
+        next = (next + 1) % Size;
+        if (filled < Size) {
+            filled++;
+        }
+        count++;
+    }
+
+    // Appends [p50,p99,max] over the window, see format_append()
+    int format(char *buf, size_t len, int n) {
+        if (filled == 0) {
+            return format_append(buf, len, n, "[]");
+        }
+        uint32_t sorted[Size];
+        memcpy(sorted, samples, filled * sizeof(sorted[0]));
+        std::sort(sorted, sorted + filled);
+        return format_append(buf, len, n, "[%u,%u,%u]", (unsigned)sorted[(filled - 1) / 2],
+                        (unsigned)sorted[(filled * 99 - 1) / 100], (unsigned)sorted[filled - 1]);
+    }
+
+    uint32_t getCount() {return count;}
+};
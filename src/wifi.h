@@ -1,17 +1,98 @@
 #pragma once
 #include <WiFi.h>
+#include <Preferences.h>
+#include <string.h>
+#include "boot.h"
+#include "debug.h"
 
+#define WIFI_CACHED_TIMEOUT 3000 // Before falling back to a full scan
+
+// Station connection that starts from the access point of the previous boot.
+// Joining with its cached channel and BSSID skips the scan, an optional
+// static address skips DHCP, and the cache is only rewritten when the access
+// point changes. Nothing blocks: begin() starts the radio, handle() follows
+// the connection from the network task.
 class Wireless {
 private:
-    const char* ssid = "";
-    const char* password = "";
+    struct Cache {
+        uint8_t bssid[6];
+        uint8_t channel;
+    };
+
+    const char *ssid = "";
+    const char *password = "";
+    Preferences preferences;
+    Cache cache = {};
+    bool joining_cached = false; // The cached access point is only tried at boot
+    bool connected = false;
+    uint32_t time_begin = 0;
+    bool static_ip = false;
+    IPAddress ip;
+    IPAddress gateway;
+    IPAddress subnet;
+
 public:
-    void setup() {
+    // Before begin()
+    void setStaticIP(IPAddress ip, IPAddress gateway, IPAddress subnet) {
+        this->static_ip = true;
+        this->ip = ip;
+        this->gateway = gateway;
+        this->subnet = subnet;
+    }
+
+    void begin(const char *ssid, const char *password) {
+        this->ssid = ssid;
+        this->password = password;
+
+        if (preferences.begin("wifi", false)) {
+            joining_cached = preferences.getBytes("ap", &cache, sizeof(cache)) == sizeof(cache);
+        }
+
+        WiFi.persistent(false); // Credentials come from the firmware, spare the flash write
         WiFi.mode(WIFI_STA);
-        WiFi.begin(ssid, password);
+        WiFi.setAutoReconnect(true);
+        if (static_ip) {
+            WiFi.config(ip, gateway, subnet, gateway);
+        }
+        if (joining_cached) {
+            WiFi.begin(ssid, password, cache.channel, cache.bssid);
+        } else {
+            WiFi.begin(ssid, password);
+        }
+        time_begin = millis();
+        boot_mark(BOOT_RADIO);
+    }
+
+    // Returns true once when the connection comes up
+    bool handle() {
+        if (!WiFi.isConnected()) {
+            connected = false;
+            if (joining_cached && millis() - time_begin > WIFI_CACHED_TIMEOUT) {
+                printd("WiFi cached access point not found, scanning");
+                joining_cached = false;
+                WiFi.disconnect();
+                WiFi.begin(ssid, password);
+            }
+            return false;
+        }
+        if (connected) {
+            return false;
+        }
+        connected = true;
+        joining_cached = false;
+        boot_mark(BOOT_WIFI);
+
+        Cache current = {};
+        memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+        current.channel = WiFi.channel();
+        if (memcmp(&current, &cache, sizeof(cache)) != 0) {
+            cache = current;
+            preferences.putBytes("ap", &cache, sizeof(cache));
+        }
+        return true;
     }
 
     bool isConnected() {
-        return WiFi.isConnected();
+        return connected;
     }
-};
\ No newline at end of file
+};
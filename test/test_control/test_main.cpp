@@ -0,0 +1,114 @@
+// Commands through the control task against the mock expanders, run with:
+// pio test -e native
+#include <unity.h>
+#include "control.h"
+
+// Ticks the control task on the virtual clock, dropping the traces
+static void run_for(uint32_t ms)
+{
+    for (uint32_t t = 0; t < ms; t += TIME_TICK) {
+        native_advance(TIME_TICK);
+        control_tick();
+        CommandTrace trace;
+        while (control_take_trace(trace)) {}
+    }
+}
+
+static bool active(const ControlSnapshot &state, uint8_t m)
+{
+    return state.motor_state[m] != Motor::MotorStates::OFF || state.motor_pending[m] != Motor::MotorStates::OFF;
+}
+
+void setUp(void) {}
+
+// Every test starts from stopped motors, past the reversal dead time
+void tearDown(void)
+{
+    command_push(MotorCommand::OFF, MOTOR_ALL, Motor::MotorStates::OFF, 0, ORIGIN_SYSTEM);
+    run_for(1000);
+}
+
+// Position 0 opened the shutter while the position was unknown
+static void test_position_zero_closes_from_unknown(void)
+{
+    TEST_ASSERT_EQUAL_UINT16(POSITION_UNKNOWN, control_snapshot().position[2]);
+    command_push(MotorCommand::POSITION, 2, Motor::MotorStates::OFF, 0, ORIGIN_MQTT);
+    run_for(TIME_TICK);
+    TEST_ASSERT_EQUAL(Motor::MotorStates::DOWN, control_snapshot().motor_state[2]);
+    run_for(control_travel_time(2));
+    TEST_ASSERT_EQUAL(Motor::MotorStates::OFF, control_snapshot().motor_state[2]);
+    TEST_ASSERT_EQUAL_UINT16(0, control_snapshot().position[2]);
+}
+
+// An intermediate target ended at the top while the position was unknown
+static void test_position_calibrates_then_reaches_target(void)
+{
+    TEST_ASSERT_EQUAL_UINT16(POSITION_UNKNOWN, control_snapshot().position[4]);
+    command_push(MotorCommand::POSITION, 4, Motor::MotorStates::OFF, 300, ORIGIN_MQTT);
+    run_for(2 * control_travel_time(4));
+    TEST_ASSERT_FALSE(active(control_snapshot(), 4));
+    TEST_ASSERT_EQUAL_UINT16(300, control_snapshot().position[4]);
+
+    // Known now, so a target is reached directly
+    command_push(MotorCommand::POSITION, 4, Motor::MotorStates::OFF, 700, ORIGIN_MQTT);
+    run_for(TIME_TICK);
+    TEST_ASSERT_EQUAL(Motor::MotorStates::UP, control_snapshot().motor_state[4]);
+    run_for(control_travel_time(4));
+    TEST_ASSERT_EQUAL_UINT16(700, control_snapshot().position[4]);
+}
+
+static void test_stop_cancels_calibration(void)
+{
+    command_push(MotorCommand::POSITION, 5, Motor::MotorStates::OFF, 600, ORIGIN_MQTT);
+    run_for(1000);
+    command_push(MotorCommand::OFF, 5, Motor::MotorStates::OFF, 0, ORIGIN_BUTTON);
+    run_for(2 * control_travel_time(5));
+    TEST_ASSERT_FALSE(active(control_snapshot(), 5));
+}
+
+// A group gesture took one queue slot per motor and was dropped in part
+// once MQTT had filled its share of the queue
+static void test_group_command_applied_whole(void)
+{
+    uint8_t queued = 0;
+    while (command_push(MotorCommand::TIMER, 0, Motor::MotorStates::OFF, 1000, ORIGIN_MQTT)) {
+        queued++;
+    }
+    TEST_ASSERT_EQUAL(CommandQueue::capacity() - NUM_COMMANDS_RESERVED, queued);
+    TEST_ASSERT_TRUE(command_push_group(MotorCommand::TOGGLE, 0xff, Motor::MotorStates::UP, 0, ORIGIN_BUTTON,
+                                        micros()));
+    run_for(TIME_TICK);
+    ControlSnapshot state = control_snapshot();
+    for (uint8_t m = 0; m < NUM_MOTORS; ++m) {
+        TEST_ASSERT_TRUE(active(state, m));
+    }
+}
+
+static void test_held_motors_only_stop(void)
+{
+    command_push(MotorCommand::TOGGLE, 1, Motor::MotorStates::UP, 0, ORIGIN_BUTTON);
+    run_for(TIME_TICK);
+    control_hold_motors(true);
+    command_push(MotorCommand::TOGGLE, 3, Motor::MotorStates::UP, 0, ORIGIN_BUTTON);
+    run_for(TIME_TICK);
+    TEST_ASSERT_FALSE(active(control_snapshot(), 3));
+
+    command_push(MotorCommand::TOGGLE, 1, Motor::MotorStates::UP, 0, ORIGIN_BUTTON);
+    run_for(TIME_TICK);
+    TEST_ASSERT_FALSE(active(control_snapshot(), 1));
+    control_hold_motors(false);
+}
+
+int main(int argc, char **argv)
+{
+    control_setup();
+    run_for(100);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_position_zero_closes_from_unknown);
+    RUN_TEST(test_position_calibrates_then_reaches_target);
+    RUN_TEST(test_stop_cancels_calibration);
+    RUN_TEST(test_group_command_applied_whole);
+    RUN_TEST(test_held_motors_only_stop);
+    return UNITY_END();
+}
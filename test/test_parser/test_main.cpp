@@ -0,0 +1,121 @@
+// MQTT topic and payload parsing, run with: pio test -e native
+#include <unity.h>
+#include "mqtt_parser.h"
+
+static MqttCommand command;
+
+static MqttParseResult parse(const char *topic, const char *payload)
+{
+    memset(&command, 0, sizeof(command));
+    return mqtt_parse(topic, (const uint8_t*)payload, strlen(payload), command);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void test_motor_in_topic(void)
+{
+    TEST_ASSERT_EQUAL(PARSE_OK, parse("cmnd/shutter/3/up", ""));
+    TEST_ASSERT_EQUAL(MotorCommand::TOGGLE, command.verb->type);
+    TEST_ASSERT_EQUAL(Motor::MotorStates::UP, command.verb->direction);
+    TEST_ASSERT_EQUAL_UINT8(3, command.motor);
+
+    TEST_ASSERT_EQUAL(PARSE_BAD_MOTOR, parse("cmnd/shutter/8/down", ""));
+    TEST_ASSERT_EQUAL(PARSE_UNKNOWN_TOPIC, parse("cmnd/shutter/3/sideways", ""));
+    TEST_ASSERT_EQUAL(PARSE_UNKNOWN_TOPIC, parse("cmnd/other/3/up", ""));
+}
+
+static void test_legacy_topics(void)
+{
+    TEST_ASSERT_EQUAL(PARSE_OK, parse("cmnd/shutter/down", " 2 "));
+    TEST_ASSERT_EQUAL_UINT8(2, command.motor);
+
+    TEST_ASSERT_EQUAL(PARSE_OK, parse("cmnd/shutter/off", "whatever"));
+    TEST_ASSERT_EQUAL_UINT8(MOTOR_ALL, command.motor);
+
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/up", ""));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/up", "1x"));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/up", "1000000000")); // Ten digits
+}
+
+static void test_position(void)
+{
+    TEST_ASSERT_EQUAL(PARSE_OK, parse("cmnd/shutter/5/position", "30"));
+    TEST_ASSERT_EQUAL_UINT8(5, command.motor);
+    TEST_ASSERT_EQUAL_UINT16(300, command.position);
+
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/5/position", "101"));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/5/position", ""));
+    TEST_ASSERT_EQUAL(PARSE_UNKNOWN_TOPIC, parse("cmnd/shutter/position", "30"));
+}
+
+static void test_bulk_targets(void)
+{
+    TEST_ASSERT_EQUAL(PARSE_OK, parse("cmnd/shutter/bulk", "0x05:up,3:down:1500"));
+    TEST_ASSERT_EQUAL_HEX8(0x0d, command.bulk.mask);
+    TEST_ASSERT_EQUAL(MotorCommand::SET, command.bulk.actions[0].type);
+    TEST_ASSERT_EQUAL(Motor::MotorStates::UP, command.bulk.actions[2].direction);
+    TEST_ASSERT_EQUAL_UINT32(control_travel_time(2), command.bulk.actions[2].duration);
+    TEST_ASSERT_EQUAL(Motor::MotorStates::DOWN, command.bulk.actions[3].direction);
+    TEST_ASSERT_EQUAL_UINT32(1500, command.bulk.actions[3].duration);
+
+    TEST_ASSERT_EQUAL(PARSE_OK, parse("cmnd/shutter/bulk", "*:off"));
+    TEST_ASSERT_EQUAL_HEX8(0xff, command.bulk.mask);
+    TEST_ASSERT_EQUAL(MotorCommand::OFF, command.bulk.actions[7].type);
+
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "0x0:up"));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "0x100:up"));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "8:up"));
+    TEST_ASSERT_EQUAL(PARSE_UNKNOWN_TOPIC, parse("cmnd/shutter/1/bulk", "1:up"));
+}
+
+static void test_bulk_syntax(void)
+{
+    TEST_ASSERT_EQUAL(PARSE_OK, parse("cmnd/shutter/bulk", " 1 : up , 2:down "));
+    TEST_ASSERT_EQUAL_HEX8(0x06, command.bulk.mask);
+
+    // A later entry for a motor overrides an earlier one
+    TEST_ASSERT_EQUAL(PARSE_OK, parse("cmnd/shutter/bulk", "*:up,4:off"));
+    TEST_ASSERT_EQUAL(MotorCommand::OFF, command.bulk.actions[4].type);
+    TEST_ASSERT_EQUAL(MotorCommand::SET, command.bulk.actions[5].type);
+
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", ""));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "1:up,,2:down"));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "1"));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "1:bulk"));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "1:up:ms"));
+}
+
+static void test_bulk_position(void)
+{
+    TEST_ASSERT_EQUAL(PARSE_OK, parse("cmnd/shutter/bulk", "2:position:50"));
+    TEST_ASSERT_EQUAL(MotorCommand::POSITION, command.bulk.actions[2].type);
+    TEST_ASSERT_EQUAL_UINT32(500, command.bulk.actions[2].duration);
+
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "2:position"));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "2:position:101"));
+}
+
+// A run without a stop timer kept the relay energised for good
+static void test_bulk_duration_bounded(void)
+{
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "2:down:0"));
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "2:up:0"));
+
+    TEST_ASSERT_EQUAL(PARSE_OK, parse("cmnd/shutter/bulk", "2:down:999999999"));
+    TEST_ASSERT_EQUAL_UINT32(control_travel_time(2), command.bulk.actions[2].duration);
+    TEST_ASSERT_EQUAL(PARSE_BAD_PAYLOAD, parse("cmnd/shutter/bulk", "2:down:1000000000"));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_motor_in_topic);
+    RUN_TEST(test_legacy_topics);
+    RUN_TEST(test_position);
+    RUN_TEST(test_bulk_targets);
+    RUN_TEST(test_bulk_syntax);
+    RUN_TEST(test_bulk_position);
+    RUN_TEST(test_bulk_duration_bounded);
+    return UNITY_END();
+}
@@ -0,0 +1,203 @@
+// Debouncer, TimerHeap, StartBudget and MpscRing, run with: pio test -e native
+#include <unity.h>
+#include "debounce.h"
+#include "ring.h"
+#include "starter.h"
+#include "timers.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void test_debouncer_flips_after_four_samples(void)
+{
+    Debouncer debouncer;
+    TEST_ASSERT_EQUAL_HEX8(0x00, debouncer.update(0x01));
+    TEST_ASSERT_EQUAL_HEX8(0x00, debouncer.update(0x01));
+    TEST_ASSERT_EQUAL_HEX8(0x00, debouncer.update(0x01));
+    TEST_ASSERT_EQUAL_HEX8(0x01, debouncer.update(0x01));
+    TEST_ASSERT_EQUAL_HEX8(0x01, debouncer.get());
+    TEST_ASSERT_EQUAL_HEX8(0x00, debouncer.update(0x01));
+}
+
+static void test_debouncer_ignores_glitches(void)
+{
+    Debouncer debouncer;
+    for (int i = 0; i < 10; ++i) {
+        TEST_ASSERT_EQUAL_HEX8(0x00, debouncer.update(0x03));
+        TEST_ASSERT_EQUAL_HEX8(0x00, debouncer.update(0x03));
+        TEST_ASSERT_EQUAL_HEX8(0x00, debouncer.update(0x03));
+        TEST_ASSERT_EQUAL_HEX8(0x00, debouncer.update(0x00)); // Resets the count
+    }
+    TEST_ASSERT_EQUAL_HEX8(0x00, debouncer.get());
+}
+
+static uint8_t fired[8];
+static uint8_t num_fired;
+
+static void record(void *arg)
+{
+    fired[num_fired++] = (uint8_t)(uintptr_t)arg;
+}
+
+static void test_timers_fire_in_deadline_order(void)
+{
+    TimerHeap<4> timers;
+    num_fired = 0;
+    TimerHeap<4>::Handle a = timers.create(record, (void*)1);
+    TimerHeap<4>::Handle b = timers.create(record, (void*)2);
+    TimerHeap<4>::Handle c = timers.create(record, (void*)3);
+    timers.start(a, 0, 300);
+    timers.start(b, 0, 100);
+    timers.start(c, 0, 200);
+    TEST_ASSERT_EQUAL_UINT32(100, timers.next(0));
+
+    timers.expire(99);
+    TEST_ASSERT_EQUAL(0, num_fired);
+    timers.expire(250);
+    TEST_ASSERT_EQUAL(2, num_fired);
+    TEST_ASSERT_EQUAL(2, fired[0]);
+    TEST_ASSERT_EQUAL(3, fired[1]);
+    TEST_ASSERT_TRUE(timers.active(a));
+}
+
+static void test_timers_cancel_and_restart(void)
+{
+    TimerHeap<4> timers;
+    num_fired = 0;
+    TimerHeap<4>::Handle a = timers.create(record, (void*)1);
+    TimerHeap<4>::Handle b = timers.create(record, (void*)2);
+    timers.start(a, 0, 100);
+    timers.start(b, 0, 200);
+    timers.cancel(a);
+    timers.start(b, 0, 50); // Moves an armed timer
+    timers.expire(60);
+    TEST_ASSERT_EQUAL(1, num_fired);
+    TEST_ASSERT_EQUAL(2, fired[0]);
+    TEST_ASSERT_FALSE(timers.active(a));
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, timers.next(60));
+}
+
+static void test_timers_wrap_around(void)
+{
+    TimerHeap<2> timers;
+    num_fired = 0;
+    TimerHeap<2>::Handle a = timers.create(record, (void*)1);
+    timers.start(a, UINT32_MAX - 10, 20);
+    timers.expire(UINT32_MAX);
+    TEST_ASSERT_EQUAL(0, num_fired);
+    timers.expire(9);
+    TEST_ASSERT_EQUAL(1, num_fired);
+}
+
+static void test_timers_out_of_handles(void)
+{
+    TimerHeap<2> timers;
+    num_fired = 0;
+    TEST_ASSERT_EQUAL(0, timers.create(record, (void*)1));
+    TEST_ASSERT_EQUAL(1, timers.create(record, (void*)2));
+    TimerHeap<2>::Handle none = timers.create(record, (void*)3);
+    TEST_ASSERT_EQUAL(TimerHeap<2>::INVALID, none);
+    timers.start(none, 0, 10); // Ignored
+    timers.cancel(none);
+    TEST_ASSERT_FALSE(timers.active(none));
+    timers.expire(100);
+    TEST_ASSERT_EQUAL(0, num_fired);
+}
+
+static void test_starts_spaced_by_gap(void)
+{
+    StartBudget<1, 4> starter;
+    num_fired = 0;
+    starter.configure(0, 4, 150, 500);
+    TEST_ASSERT_TRUE(starter.request(0, 0, record, (void*)1));
+    TEST_ASSERT_FALSE(starter.request(0, 10, record, (void*)2));
+    TEST_ASSERT_EQUAL_UINT32(140, starter.next(10));
+    starter.handle(149);
+    TEST_ASSERT_EQUAL(0, num_fired);
+    starter.handle(150);
+    TEST_ASSERT_EQUAL(1, num_fired);
+    TEST_ASSERT_EQUAL(2, fired[0]);
+}
+
+static void test_starts_limited_per_inrush_window(void)
+{
+    StartBudget<1, 4> starter;
+    num_fired = 0;
+    starter.configure(0, 2, 0, 500);
+    TEST_ASSERT_TRUE(starter.request(0, 0, record, (void*)1));
+    TEST_ASSERT_TRUE(starter.request(0, 100, record, (void*)2));
+    TEST_ASSERT_FALSE(starter.request(0, 200, record, (void*)3));
+    TEST_ASSERT_FALSE(starter.request(0, 200, record, (void*)4));
+    starter.handle(499);
+    TEST_ASSERT_EQUAL(0, num_fired);
+    starter.handle(500); // The oldest start left the window, one more fits
+    TEST_ASSERT_EQUAL(1, num_fired);
+    TEST_ASSERT_EQUAL(3, fired[0]);
+    starter.handle(600);
+    TEST_ASSERT_EQUAL(2, num_fired);
+    TEST_ASSERT_EQUAL(4, fired[1]);
+}
+
+static void test_starts_cancelled(void)
+{
+    StartBudget<1, 4> starter;
+    num_fired = 0;
+    starter.configure(0, 1, 100, 0);
+    TEST_ASSERT_TRUE(starter.request(0, 0, record, (void*)1));
+    TEST_ASSERT_FALSE(starter.request(0, 0, record, (void*)2));
+    starter.cancel((void*)2);
+    TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, starter.next(0));
+    starter.handle(1000);
+    TEST_ASSERT_EQUAL(0, num_fired);
+}
+
+static void test_ring_fifo_and_drops(void)
+{
+    MpscRing<int, 4> ring;
+    for (int i = 0; i < 4; ++i) {
+        TEST_ASSERT_TRUE(ring.push(i));
+    }
+    TEST_ASSERT_FALSE(ring.push(4));
+    TEST_ASSERT_EQUAL_UINT32(1, ring.dropped());
+    TEST_ASSERT_EQUAL_UINT32(4, ring.high_water());
+
+    int value;
+    for (int i = 0; i < 4; ++i) {
+        TEST_ASSERT_TRUE(ring.pop(value));
+        TEST_ASSERT_EQUAL(i, value);
+    }
+    TEST_ASSERT_FALSE(ring.pop(value));
+    TEST_ASSERT_EQUAL_UINT32(0, ring.depth());
+    TEST_ASSERT_EQUAL_UINT32(4, ring.pushed());
+}
+
+static void test_ring_reserve(void)
+{
+    MpscRing<int, 8> ring;
+    int pushed = 0;
+    for (int i = 0; i < 8; ++i) {
+        pushed += ring.push(i, 3);
+    }
+    TEST_ASSERT_EQUAL(5, pushed); // Three slots are kept
+    TEST_ASSERT_TRUE(ring.push(100));
+    TEST_ASSERT_TRUE(ring.push(101));
+    TEST_ASSERT_TRUE(ring.push(102));
+    TEST_ASSERT_FALSE(ring.push(103));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_debouncer_flips_after_four_samples);
+    RUN_TEST(test_debouncer_ignores_glitches);
+    RUN_TEST(test_timers_fire_in_deadline_order);
+    RUN_TEST(test_timers_cancel_and_restart);
+    RUN_TEST(test_timers_wrap_around);
+    RUN_TEST(test_timers_out_of_handles);
+    RUN_TEST(test_starts_spaced_by_gap);
+    RUN_TEST(test_starts_limited_per_inrush_window);
+    RUN_TEST(test_starts_cancelled);
+    RUN_TEST(test_ring_fifo_and_drops);
+    RUN_TEST(test_ring_reserve);
+    return UNITY_END();
+}